@@ -0,0 +1,51 @@
+#!/usr/bin/env bash
+#
+# Copyright (c) 2024, CATIE
+# SPDX-License-Identifier: Apache-2.0
+#
+# Build and run loop shared by the bench_*.sh scripts, to be sourced.
+#
+# A benchmark sets PROFILES to its ordered "profile:overlay" list (an empty
+# overlay being the default configuration), defines
+#
+#   bench_parse <profile> <build dir> <run log>
+#
+# which appends the line of the profile to report, then calls bench_run.
+
+APP_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+BOARD=qemu_x86
+
+report=()
+
+# bench_run <name> <run timeout in seconds> [CMake argument...]
+#
+# Build each profile in build/bench_<name>_<profile> with the CMake arguments
+# and its overlay, run it until the timeout, then parse its log.
+bench_run() {
+    local name="$1"
+    local run_timeout="$2"
+    local entry profile overlay build_dir log
+    local extra
+
+    shift 2
+    mkdir -p "${APP_DIR}/build"
+
+    for entry in "${PROFILES[@]}"; do
+        profile="${entry%%:*}"
+        overlay="${entry#*:}"
+        build_dir="${APP_DIR}/build/bench_${name}_${profile}"
+        extra=("$@")
+
+        if [[ -n "${overlay}" ]]; then
+            extra+=(-DEXTRA_CONF_FILE="${overlay}")
+        fi
+
+        west build -p always -b "${BOARD}" -d "${build_dir}" "${APP_DIR}" -- \
+            ${extra[@]+"${extra[@]}"} > "${build_dir}.build.log" 2>&1
+
+        log="${build_dir}.run.log"
+        timeout "${run_timeout}" west build -d "${build_dir}" -t run > "${log}" 2>&1 || true
+
+        bench_parse "${profile}" "${build_dir}" "${log}"
+    done
+}
@@ -0,0 +1,43 @@
+#!/usr/bin/env bash
+#
+# Copyright (c) 2024, CATIE
+# SPDX-License-Identifier: Apache-2.0
+#
+# Compare firmware download throughput on qemu_x86 with the verbose (every
+# chunk traced, immediate output), the default and the production logging
+# profiles.
+#
+# Requires real credentials in src/creds (see README.rst), QEMU NAT
+# networking and a firmware assigned to the device on the ThingsBoard server
+# with a version different from the running one.
+#
+# Usage: scripts/bench_ota_logging.sh [run timeout in seconds]
+
+set -euo pipefail
+
+source "$(dirname "$0")/bench_common.sh"
+
+RUN_TIMEOUT="${1:-300}"
+
+PROFILES=(
+    "verbose:overlay-log-verbose.conf"
+    "default:"
+    "prod:overlay-log-prod.conf"
+)
+
+bench_parse() {
+    local profile="$1" log="$3"
+    local result bytes ms rate
+
+    # "Firmware download completed: chunk N/N, B B in T ms (R B/s)"
+    result=$(sed -n 's/.*Firmware download completed: .*, \([0-9]*\) B in \([0-9]*\) ms (\([0-9]*\) B\/s).*/\1 \2 \3/p' \
+        "${log}" | head -n1)
+    read -r bytes ms rate <<< "${result:-n/a n/a n/a}"
+
+    report+=("$(printf '%-8s %12s %10s %10s' "${profile}" "${bytes}" "${ms}" "${rate}")")
+}
+
+bench_run log "${RUN_TIMEOUT}"
+
+printf '%-8s %12s %10s %10s\n' profile "bytes" "ms" "B/s"
+printf '%s\n' "${report[@]}"
@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+#
+# Copyright (c) 2024, CATIE
+# SPDX-License-Identifier: Apache-2.0
+#
+# Compare firmware download and telemetry throughput on qemu_x86, with the
+# chunks sharing the main MQTT session or using the dedicated OTA session.
+# Telemetry is published every second to load the main session during the
+# download.
+#
+# Requires real credentials in src/creds (see README.rst), QEMU NAT
+# networking and a firmware assigned to the device on the ThingsBoard server
+# with a version different from the running one.
+#
+# Usage: scripts/bench_ota_session.sh [run timeout in seconds]
+
+set -euo pipefail
+
+source "$(dirname "$0")/bench_common.sh"
+
+RUN_TIMEOUT="${1:-300}"
+
+PROFILES=(
+    "shared:"
+    "ota:overlay-ota-session.conf"
+)
+
+bench_parse() {
+    local profile="$1" log="$3"
+    local ota_rate telemetry tlm_avg tlm_max tlm_rate
+
+    # "Firmware download completed: chunk N/N, B B in T ms (R B/s)"
+    ota_rate=$(sed -n 's/.*Firmware download completed: .* (\([0-9]*\) B\/s).*/\1/p' \
+        "${log}" | head -n1)
+
+    # Telemetry windows logged until the download completed
+    telemetry=$(sed -n '/Firmware download completed/q; s/.*Telemetry: .* avg \([0-9]*\) ms max \([0-9]*\) ms (\([0-9]*\) B\/s).*/\1 \2 \3/p' \
+        "${log}" | tail -n1)
+    read -r tlm_avg tlm_max tlm_rate <<< "${telemetry:-n/a n/a n/a}"
+
+    report+=("$(printf '%-8s %14s %16s %16s %14s' "${profile}" "${ota_rate:-n/a}" \
+        "${tlm_rate}" "${tlm_avg}" "${tlm_max}")")
+}
+
+bench_run session "${RUN_TIMEOUT}" -DCONFIG_TB_TELEMETRY_PERIOD_SEC=1
+
+printf '%-8s %14s %16s %16s %14s\n' session "OTA (B/s)" "telemetry (B/s)" \
+    "ack avg (ms)" "ack max (ms)"
+printf '%s\n' "${report[@]}"
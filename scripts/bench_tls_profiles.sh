@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+#
+# Copyright (c) 2024, CATIE
+# SPDX-License-Identifier: Apache-2.0
+#
+# Compare the default and lean TLS profiles on qemu_x86: flash size, TLS
+# handshake time and CPU time, and mbedTLS heap peak.
+#
+# Requires real credentials in src/creds (see README.rst) and QEMU NAT
+# networking to reach the broker.
+#
+# Usage: scripts/bench_tls_profiles.sh [run timeout in seconds]
+
+set -euo pipefail
+
+source "$(dirname "$0")/bench_common.sh"
+
+RUN_TIMEOUT="${1:-60}"
+
+PROFILES=(
+    "default:"
+    "lean:overlay-tls-lean.conf"
+)
+
+bench_parse() {
+    local profile="$1" build_dir="$2" log="$3"
+    local flash handshake cpu heap
+
+    # text + data is what ends up in flash
+    flash=$(size "${build_dir}/zephyr/zephyr.elf" | awk 'NR == 2 { print $1 + $2 }')
+
+    handshake=$(sed -n 's/.*TLS handshake: \([0-9]*\) ms.*/\1/p' "${log}" | head -n1)
+    cpu=$(sed -n 's/.*TLS handshake CPU: \([0-9]*\) us.*/\1/p' "${log}" | head -n1)
+    heap=$(sed -n 's/.*TLS handshake heap peak: \([0-9]*\) B.*/\1/p' "${log}" | head -n1)
+
+    report+=("$(printf '%-8s %10s %14s %14s %12s' "${profile}" "${flash}" \
+        "${handshake:-n/a}" "${cpu:-n/a}" "${heap:-n/a}")")
+}
+
+bench_run tls "${RUN_TIMEOUT}" -DCONFIG_THREAD_RUNTIME_STATS=y \
+    -DCONFIG_MBEDTLS_MEMORY_DEBUG=y
+
+printf '%-8s %10s %14s %14s %12s\n' profile "flash (B)" "handshake (ms)" \
+    "CPU (us)" "heap (B)"
+printf '%s\n' "${report[@]}"
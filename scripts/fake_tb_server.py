@@ -0,0 +1,332 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024, CATIE
+# SPDX-License-Identifier: Apache-2.0
+#
+"""Minimal ThingsBoard MQTT device API server for fleet load tests.
+
+Speaks just enough MQTT 3.1.1 (no TLS, QoS 0 and 1, no retained messages)
+to serve the requests of the firmware client:
+
+- attribute requests on v1/devices/me/attributes/request/<id>, answered on
+  v1/devices/me/attributes/response/<id> with the shared keys asked for,
+- firmware chunk requests on v2/fw/request/<id>/chunk/<n>, answered on
+  v2/fw/response/<id>/chunk/<n> with the chunk bytes (empty past the end),
+- telemetry on v1/devices/me/telemetry, only counted.
+
+As on ThingsBoard, "me" topics are per device: a device is identified by
+its access token (the MQTT user name, or the client id without one) and
+responses go back on the connection which sent the request, so a
+dedicated OTA session of the same device gets its own chunks.
+
+A firmware rollout is started after --rollout-delay seconds: the firmware
+shared attributes are pushed on v1/devices/me/attributes to --rollout-rate
+devices per second, in connection order. Statistics are printed every
+--report seconds.
+
+Usage: scripts/fake_tb_server.py [--port 1883] [--fw-size 65536] ...
+"""
+
+import argparse
+import asyncio
+import hashlib
+import json
+import os
+import random
+import struct
+import time
+
+CONNECT = 1
+CONNACK = 2
+PUBLISH = 3
+PUBACK = 4
+SUBSCRIBE = 8
+SUBACK = 9
+UNSUBSCRIBE = 10
+UNSUBACK = 11
+PINGREQ = 12
+PINGRESP = 13
+DISCONNECT = 14
+
+ATTR_TOPIC = "v1/devices/me/attributes"
+ATTR_REQUEST_PREFIX = "v1/devices/me/attributes/request/"
+TELEMETRY_TOPIC = "v1/devices/me/telemetry"
+FW_REQUEST_PREFIX = "v2/fw/request/"
+
+
+def encode_length(length):
+    out = bytearray()
+    while True:
+        byte = length % 128
+        length //= 128
+        if length > 0:
+            byte |= 0x80
+        out.append(byte)
+        if length == 0:
+            return bytes(out)
+
+
+def encode_string(value):
+    data = value.encode()
+    return struct.pack("!H", len(data)) + data
+
+
+def packet(ptype, flags, body):
+    return bytes([(ptype << 4) | flags]) + encode_length(len(body)) + body
+
+
+def decode_string(data, offset):
+    (length,) = struct.unpack_from("!H", data, offset)
+    offset += 2
+    return data[offset:offset + length].decode(), offset + length
+
+
+class Stats:
+    def __init__(self):
+        self.connections = 0
+        self.connected = 0
+        self.attr_requests = 0
+        self.telemetry = 0
+        self.chunks = 0
+        self.chunk_bytes = 0
+        self.dropped = 0
+        self.completed = set()
+        self.started = set()
+        self.last_report = time.monotonic()
+        self.last_bytes = 0
+
+
+class Firmware:
+    def __init__(self, title, version, size):
+        self.title = title
+        self.version = version
+        self.data = os.urandom(size)
+
+    def attributes(self):
+        return {
+            "fw_title": self.title,
+            "fw_version": self.version,
+            "fw_size": len(self.data),
+            "fw_checksum": hashlib.sha256(self.data).hexdigest(),
+            "fw_checksum_algorithm": "SHA256",
+        }
+
+
+class Server:
+    def __init__(self, args):
+        self.args = args
+        self.stats = Stats()
+        self.firmware = Firmware(args.fw_title, args.fw_version, args.fw_size)
+        # token -> True once the firmware is assigned to the device
+        self.assigned = {}
+        # token -> writer of the main session, for attribute pushes
+        self.sessions = {}
+
+    def shared_attributes(self, token):
+        if not self.assigned.get(token):
+            return {}
+        return self.firmware.attributes()
+
+    async def handle(self, reader, writer):
+        token = None
+        client_id = None
+
+        try:
+            while True:
+                header = await reader.readexactly(1)
+                length = 0
+                multiplier = 1
+                while True:
+                    byte = (await reader.readexactly(1))[0]
+                    length += (byte & 0x7F) * multiplier
+                    multiplier *= 128
+                    if not byte & 0x80:
+                        break
+                body = await reader.readexactly(length) if length else b""
+                ptype = header[0] >> 4
+
+                if ptype == CONNECT:
+                    client_id, token = self.on_connect(body)
+                    if not client_id.endswith("-ota"):
+                        self.sessions[token] = writer
+                        self.assigned.setdefault(token, False)
+                    self.stats.connections += 1
+                    self.stats.connected += 1
+                    writer.write(packet(CONNACK, 0, b"\x00\x00"))
+                elif ptype == SUBSCRIBE:
+                    self.on_subscribe(writer, body)
+                elif ptype == UNSUBSCRIBE:
+                    writer.write(packet(UNSUBACK, 0, body[:2]))
+                elif ptype == PUBLISH:
+                    self.on_publish(writer, token, header[0] & 0x0F, body)
+                elif ptype == PINGREQ:
+                    writer.write(packet(PINGRESP, 0, b""))
+                elif ptype == DISCONNECT:
+                    break
+
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            if client_id is not None:
+                self.stats.connected -= 1
+                if self.sessions.get(token) is writer:
+                    del self.sessions[token]
+            writer.close()
+
+    def on_connect(self, body):
+        _, offset = decode_string(body, 0)  # protocol name
+        flags = body[offset + 1]
+        offset += 4  # level, flags, keepalive
+        client_id, offset = decode_string(body, offset)
+        if flags & 0x04:  # will topic and message
+            _, offset = decode_string(body, offset)
+            _, offset = decode_string(body, offset)
+        token = client_id
+        if flags & 0x80:
+            token, offset = decode_string(body, offset)
+        elif client_id.endswith("-ota"):
+            token = client_id[:-len("-ota")]
+        return client_id, token
+
+    def on_subscribe(self, writer, body):
+        packet_id = body[:2]
+        offset = 2
+        granted = bytearray()
+        while offset < len(body):
+            _, offset = decode_string(body, offset)
+            granted.append(min(body[offset], 1))
+            offset += 1
+        writer.write(packet(SUBACK, 0, packet_id + bytes(granted)))
+
+    def on_publish(self, writer, token, flags, body):
+        qos = (flags >> 1) & 0x03
+        topic, offset = decode_string(body, 0)
+        if qos > 0:
+            writer.write(packet(PUBACK, 0, body[offset:offset + 2]))
+            offset += 2
+        payload = body[offset:]
+
+        if topic == TELEMETRY_TOPIC:
+            self.stats.telemetry += 1
+        elif topic.startswith(ATTR_REQUEST_PREFIX):
+            self.on_attr_request(writer, token, topic, payload)
+        elif topic.startswith(FW_REQUEST_PREFIX):
+            self.on_chunk_request(writer, token, topic, payload)
+
+    def on_attr_request(self, writer, token, topic, payload):
+        request_id = topic[len(ATTR_REQUEST_PREFIX):]
+        try:
+            keys = json.loads(payload or b"{}").get("sharedKeys", "")
+        except ValueError:
+            keys = ""
+        wanted = [key for key in keys.split(",") if key]
+        shared = self.shared_attributes(token)
+        if wanted:
+            shared = {key: shared[key] for key in wanted if key in shared}
+
+        self.stats.attr_requests += 1
+        response = json.dumps({"shared": shared},
+                              separators=(",", ":")).encode()
+        self.publish(writer, "v1/devices/me/attributes/response/" + request_id,
+                     response)
+
+    def on_chunk_request(self, writer, token, topic, payload):
+        # v2/fw/request/<id>/chunk/<n>
+        parts = topic.split("/")
+        if len(parts) != 6:
+            return
+        request_id, chunk = parts[3], int(parts[5])
+        try:
+            size = int(payload or b"0")
+        except ValueError:
+            size = 0
+        size = size if size > 0 else len(self.firmware.data)
+
+        data = self.firmware.data[chunk * size:(chunk + 1) * size]
+        if not data:
+            self.stats.completed.add(token)
+        elif chunk == 0:
+            self.stats.started.add(token)
+
+        if data and random.random() < self.args.drop_rate:
+            self.stats.dropped += 1
+            return
+
+        self.stats.chunks += 1
+        self.stats.chunk_bytes += len(data)
+        self.publish(writer, "v2/fw/response/%s/chunk/%d" % (request_id, chunk),
+                     data)
+
+    @staticmethod
+    def publish(writer, topic, payload):
+        # QoS 0: the client does not acknowledge received messages.
+        writer.write(packet(PUBLISH, 0, encode_string(topic) + payload))
+
+    async def rollout(self):
+        await asyncio.sleep(self.args.rollout_delay)
+        print("Rollout of %s %s (%u B) at %u device(s)/s" %
+              (self.firmware.title, self.firmware.version,
+               len(self.firmware.data), self.args.rollout_rate), flush=True)
+
+        update = json.dumps(self.firmware.attributes(),
+                            separators=(",", ":")).encode()
+        while True:
+            pending = [token for token, done in self.assigned.items() if not done]
+            for token in pending[:self.args.rollout_rate]:
+                self.assigned[token] = True
+                writer = self.sessions.get(token)
+                if writer is not None:
+                    self.publish(writer, ATTR_TOPIC, update)
+            await asyncio.sleep(1)
+
+    async def report(self):
+        while True:
+            await asyncio.sleep(self.args.report)
+            stats = self.stats
+            now = time.monotonic()
+            rate = (stats.chunk_bytes - stats.last_bytes) / (now - stats.last_report)
+            stats.last_report, stats.last_bytes = now, stats.chunk_bytes
+
+            print("connected %u (%u connections), assigned %u, started %u, "
+                  "completed %u, chunks %u (%u dropped), %.0f B/s, "
+                  "attribute requests %u, telemetry %u" %
+                  (stats.connected, stats.connections,
+                   sum(self.assigned.values()), len(stats.started),
+                   len(stats.completed), stats.chunks, stats.dropped, rate,
+                   stats.attr_requests, stats.telemetry), flush=True)
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--fw-title", default="fleet-sim")
+    parser.add_argument("--fw-version", default="2.0.0")
+    parser.add_argument("--fw-size", type=int, default=64 * 1024,
+                        help="firmware size in bytes")
+    parser.add_argument("--rollout-delay", type=float, default=30.0,
+                        help="seconds before the rollout starts")
+    parser.add_argument("--rollout-rate", type=int, default=10,
+                        help="devices assigned per second")
+    parser.add_argument("--drop-rate", type=float, default=0.0,
+                        help="fraction of chunk responses dropped")
+    parser.add_argument("--report", type=float, default=5.0,
+                        help="statistics period in seconds")
+    args = parser.parse_args()
+
+    server = Server(args)
+    listener = await asyncio.start_server(server.handle, args.host, args.port,
+                                          backlog=1024)
+    print("Listening on %s:%u" % (args.host, args.port), flush=True)
+
+    async with listener:
+        await asyncio.gather(listener.serve_forever(), server.rollout(),
+                             server.report())
+
+
+if __name__ == "__main__":
+    try:
+        asyncio.run(main())
+    except KeyboardInterrupt:
+        pass
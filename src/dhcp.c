@@ -7,7 +7,7 @@
 
 #include <zephyr/logging/log.h>
 
-LOG_MODULE_DECLARE(tb, LOG_LEVEL_DBG);
+LOG_MODULE_DECLARE(tb, CONFIG_TB_LOG_LEVEL);
 
 #include <zephyr/kernel.h>
 
@@ -45,16 +45,30 @@ static void handler(struct net_mgmt_event_callback *cb, uint32_t mgmt_event,
 }
 
 /**
- * Start a DHCP client, and wait for a lease to be acquired.
+ * Start a DHCP client, without waiting for the lease.
  */
-void app_dhcpv4_startup(void) {
+void app_dhcpv4_start(void) {
   LOG_INF("starting DHCPv4");
 
   net_mgmt_init_event_callback(&mgmt_cb, handler, NET_EVENT_IPV4_ADDR_ADD);
   net_mgmt_add_event_callback(&mgmt_cb);
 
   net_dhcpv4_start(net_if_get_default());
+}
+
+/**
+ * Wait for a lease to be acquired, return -EAGAIN on timeout.
+ */
+int app_dhcpv4_wait(k_timeout_t timeout) {
+  return k_sem_take(&got_address, timeout);
+}
+
+/**
+ * Start a DHCP client, and wait for a lease to be acquired.
+ */
+void app_dhcpv4_startup(void) {
+  app_dhcpv4_start();
 
   /* Wait for a lease. */
-  k_sem_take(&got_address, K_FOREVER);
+  app_dhcpv4_wait(K_FOREVER);
 }
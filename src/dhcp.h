@@ -10,6 +10,10 @@
 #ifndef __DHCP_H__
 #define __DHCP_H__
 
+#include <zephyr/kernel.h>
+
+void app_dhcpv4_start(void);
+int app_dhcpv4_wait(k_timeout_t timeout);
 void app_dhcpv4_startup(void);
 
 #endif
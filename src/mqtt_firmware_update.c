@@ -1,4 +1,11 @@
 #include "mqtt_firmware_update.h"
+#include "tb_attr_cache.h"
+#include "tb_client.h"
+#include "tb_events.h"
+#include "tb_latency.h"
+#if defined(CONFIG_TB_OTA_SESSION)
+#include "tb_ota_session.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,85 +14,150 @@
 #include <zephyr/net/mqtt.h>
 #include <zephyr/random/random.h>
 
-struct mqtt_client client_ctx;
-int firmware_request_id = 10;
-int chunk_count = 0;
-int chunk_number = 0;
-int firmware_chunk_size = 256;
-
-bool do_firmware_update = false;
-
-LOG_MODULE_REGISTER(tb, LOG_LEVEL_INF);
-
-struct shared_info {
-    const char *fw_checksum;
-    int fw_size;
-    const char *fw_title;
-    const char *fw_checksum_algorithm;
-    const char *fw_version;
-};
-
-struct firmware_info {
-    struct shared_info shared;
-};
-
-static const struct json_obj_descr shared_info_descr[] = {
-    JSON_OBJ_DESCR_PRIM(struct shared_info, fw_checksum, JSON_TOK_STRING),
-    JSON_OBJ_DESCR_PRIM(struct shared_info, fw_size, JSON_TOK_NUMBER),
-    JSON_OBJ_DESCR_PRIM(struct shared_info, fw_title, JSON_TOK_STRING),
-    JSON_OBJ_DESCR_PRIM(struct shared_info, fw_checksum_algorithm, JSON_TOK_STRING),
-    JSON_OBJ_DESCR_PRIM(struct shared_info, fw_version, JSON_TOK_STRING),
-};
-
-static const struct json_obj_descr firmware_info_descr[] = {
-    JSON_OBJ_DESCR_OBJECT(struct firmware_info, shared, shared_info_descr),
-};
-
-int parse_firmware_info(const char *json, struct firmware_info *info) {
-    int ret = json_obj_parse(json, strlen(json), firmware_info_descr, ARRAY_SIZE(firmware_info_descr), info);
-    if (ret < 0) {
-        LOG_ERR("JSON Parse Error: %d", ret);
-        return ret;
+LOG_MODULE_REGISTER(tb, CONFIG_TB_LOG_LEVEL);
+
+/* Keys which, when pushed by the server, require a new firmware check. */
+#define FIRMWARE_UPDATE_KEYS                                                  \
+    (BIT(TB_ATTR_FW_CHECKSUM) | BIT(TB_ATTR_FW_SIZE) | BIT(TB_ATTR_FW_TITLE) | \
+     BIT(TB_ATTR_FW_VERSION))
+
+#define ATTR_RESPONSE_TOPIC "v1/devices/me/attributes/response/"
+
+char current_firmware_version[24];
+char current_firmware_title[64];
+
+void firmware_init(struct tb_firmware *firmware) {
+    memset(firmware, 0, sizeof(*firmware));
+
+    firmware->request_id = 10;
+#if defined(CONFIG_TB_OTA_SESSION)
+    firmware->chunk_size = CONFIG_TB_OTA_CHUNK_SIZE;
+#else
+    firmware->chunk_size = 256;
+#endif
+}
+
+/* Start a download if the assigned firmware differs from the running one. */
+static void check_firmware_update(struct tb_client *client, uint32_t changed) {
+    struct tb_firmware *fw = &client->firmware;
+    const char *fw_title = tb_attr_get(&client->attrs, TB_ATTR_FW_TITLE);
+    const char *fw_version = tb_attr_get(&client->attrs, TB_ATTR_FW_VERSION);
+    int fw_size = atoi(tb_attr_get(&client->attrs, TB_ATTR_FW_SIZE));
+
+    LOG_INF("Firmware title: %s", fw_title);
+    LOG_INF("Firmware version: %s (v%u)", fw_version,
+            tb_attr_version(&client->attrs, TB_ATTR_FW_VERSION));
+    LOG_INF("Firmware size: %d", fw_size);
+
+    if (fw_version[0] == '\0') {
+        LOG_INF("No firmware assigned to the device");
+        return;
+    }
+
+    if (fw->download_active && !(changed & FIRMWARE_UPDATE_KEYS)) {
+        LOG_DBG("Firmware download already in progress");
+        return;
+    }
+
+    // Check if new firmware is available
+    if (strcmp(fw_version, current_firmware_version) != 0) {
+        LOG_INF("New firmware version available: %s - %s", fw_title, fw_version);
+        char telemetry_payload[200];
+        snprintf(telemetry_payload, sizeof(telemetry_payload),
+                 "{\"fw_state\" :\"DOWNLOADING\", \"current_fw_version\":\"%s\", "
+                 "\"current_fw_title\":\"%s\"}",
+                 current_firmware_version, current_firmware_title);
+        send_telemetry(client, telemetry_payload);
+
+        fw->request_id++;
+
+        fw->chunk_count = (fw_size + fw->chunk_size - 1) / fw->chunk_size;
+        LOG_INF("Chunk count: %d", fw->chunk_count);
+
+        fw->chunk_number = 0;
+        fw->chunk_retries = 0;
+        fw->download_bytes = 0u;
+        fw->download_start_ms = k_uptime_get();
+        fw->download_active = true;
+#if defined(CONFIG_TB_OTA_SESSION)
+        tb_event_post(&client->events, TB_EVENT_OTA_OPEN);
+#else
+        /* Give the server time to switch the device state first. */
+        tb_event_schedule(&client->events, TB_EVENT_CHUNK_REQUEST,
+                          K_SECONDS(1));
+#endif
+    } else {
+        LOG_INF("Firmware version is up to date: %s", fw_version);
     }
-    return 0;
 }
 
-void process_firmware_info(const char *json_payload) {
-    struct firmware_info info;
-
-    //const char *test_payload = "{\"shared\":{\"fw_checksum\":\"dummy_checksum\",\"fw_size\":12345,\"fw_title\":\"TEST_TITLE\",\"fw_checksum_algorithm\":\"SHA256\",\"fw_version\":\"TEST_VERSION\"}}";
-    //printf("Test payload: %s\n", test_payload);
-
-    if (parse_firmware_info(json_payload, &info) == 0) {
-        LOG_INF("Firmware title: %s", info.shared.fw_title);
-        LOG_INF("Firmware version: %s", info.shared.fw_version);
-        LOG_INF("Firmware size: %d", info.shared.fw_size);
-        
-        // Check if new firmware is available
-        if (strcmp(info.shared.fw_version, current_firmware_version) != 0) {
-            LOG_INF("New firmware version available: %s - %s", info.shared.fw_title, info.shared.fw_version);
-            char telemetry_payload[200];
-            snprintf(telemetry_payload, sizeof(telemetry_payload),
-                     "{\"fw_state\" :\"DOWNLOADING\", \"current_fw_version\":\"%s\", "
-                     "\"current_fw_title\":\"%s\"}",
-                     current_firmware_version, current_firmware_title);
-            send_telemetry(telemetry_payload);
-            k_sleep(K_SECONDS(1));
-
-            firmware_request_id++;
-
-            chunk_count = (info.shared.fw_size + firmware_chunk_size - 1) / firmware_chunk_size;
-            LOG_INF("Chunk count: %d", chunk_count);
-
-            get_firmware(0);
-        } else {
-            LOG_INF("Firmware version is up to date: %s", info.shared.fw_version);
-        }
+void firmware_update_reset(struct tb_client *client) {
+    client->firmware.download_active = false;
+}
+
+static void firmware_download_finished(struct tb_client *client) {
+    client->firmware.download_active = false;
+
+#if defined(CONFIG_TB_OTA_SESSION)
+    tb_event_post(&client->events, TB_EVENT_OTA_CLOSE);
+#endif
+}
+
+#if defined(CONFIG_TB_OTA_SESSION)
+void firmware_ota_open_handler(struct tb_events *events) {
+    struct tb_client *client = CONTAINER_OF(events, struct tb_client, events);
+
+    if (!client->firmware.download_active) {
+        return;
+    }
+
+    if (tb_ota_session_open(&client->ota) != 0) {
+        LOG_WRN("Downloading on the main session");
+        tb_event_post(events, TB_EVENT_CHUNK_REQUEST);
+    } else if (tb_ota_session_ready(&client->ota)) {
+        /* Restarted download, the session is already subscribed. */
+        tb_event_post(events, TB_EVENT_CHUNK_REQUEST);
     } else {
-        LOG_ERR("Failed to parse firmware info.");
+        /* Started on subscription, or on the main session if it never
+         * comes.
+         */
+        tb_event_schedule(events, TB_EVENT_CHUNK_REQUEST,
+                          K_MSEC(CONFIG_TB_CHUNK_TIMEOUT_MS));
     }
 }
 
+void firmware_ota_connected_handler(struct tb_events *events) {
+    struct tb_client *client = CONTAINER_OF(events, struct tb_client, events);
+
+    /* The download may have ended during the handshake. */
+    if (!client->firmware.download_active) {
+        tb_ota_session_close(&client->ota);
+    }
+}
+
+void firmware_ota_close_handler(struct tb_events *events) {
+    struct tb_client *client = CONTAINER_OF(events, struct tb_client, events);
+
+    /* Kept for a download restarted since the close was posted. */
+    if (client->firmware.download_active) {
+        return;
+    }
+
+    tb_ota_session_close(&client->ota);
+}
+#endif
+
+/* Chunks go through the OTA session when it is up. */
+static struct mqtt_client *firmware_client(struct tb_client *client) {
+#if defined(CONFIG_TB_OTA_SESSION)
+    if (tb_ota_session_ready(&client->ota)) {
+        return tb_ota_session_client(&client->ota);
+    }
+#endif
+
+    return &client->mqtt;
+}
+
 char *current_firmware_to_json() {
     static char firmware_infos[256];
     snprintf(firmware_infos, sizeof(firmware_infos),
@@ -94,18 +166,21 @@ char *current_firmware_to_json() {
     return firmware_infos;
 }
 
-int update_response_topic_name(char *topic_name) {
-    snprintf(topic_name, 256, "v2/fw/response/%d/chunk/", firmware_request_id);
+int update_response_topic_name(struct tb_client *client, char *topic_name) {
+    snprintf(topic_name, 256, "v2/fw/response/%d/chunk/",
+             client->firmware.request_id);
     return 0;
 }
 
-int update_request_topic_name(char *topic_name, int chunk_number) {
-    snprintf(topic_name, 256, "v2/fw/request/%d/chunk/%d", firmware_request_id,
-             chunk_number);
+int update_request_topic_name(struct tb_client *client, char *topic_name,
+                              int chunk_number) {
+    snprintf(topic_name, 256, "v2/fw/request/%d/chunk/%d",
+             client->firmware.request_id, chunk_number);
     return 0;
 }
 
-int send_message(char *topic, char *payload) {
+static int send_message_on(struct mqtt_client *session, char *topic,
+                           char *payload) {
     struct mqtt_publish_param param;
     param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
     param.message.topic.topic.utf8 = topic;
@@ -116,18 +191,22 @@ int send_message(char *topic, char *payload) {
     param.dup_flag = 0;
     param.retain_flag = 0;
 
-    int ret = mqtt_publish(&client_ctx, &param);
+    int ret = mqtt_publish(session, &param);
     if (ret) {
         LOG_ERR("Failed to publish message to topic %s: %d", topic, ret);
     } else {
-        LOG_INF("Message published successfully to topic %s", topic);
+        LOG_DBG("Message published successfully to topic %s", topic);
     }
     return ret;
 }
 
+int send_message(struct tb_client *client, char *topic, char *payload) {
+    return send_message_on(&client->mqtt, topic, payload);
+}
+
 // Payload is the firmware binary chunk
 int store_firmware_chunk(void *payload, int chunk_number, int chunk_len) {
-    LOG_INF("TODO: write chunk %d (len:%d) to flash", chunk_number, chunk_len);
+    LOG_DBG("TODO: write chunk %d (len:%d) to flash", chunk_number, chunk_len);
 
     // Store the firmware chunk in the flash memory
     // The firmware binary chunk is stored in the payload variable
@@ -135,15 +214,23 @@ int store_firmware_chunk(void *payload, int chunk_number, int chunk_len) {
     return 0;
 }
 
-int request_firmware_info() {
+int request_firmware_info(struct tb_client *client) {
+    char keys[128];
+    int rc = tb_attr_cache_build_request(&client->attrs, keys, sizeof(keys));
+    if (rc < 0) {
+        LOG_ERR("Failed to build firmware info request: %d", rc);
+        return rc;
+    } else if (rc == 0) {
+        LOG_INF("Firmware info cached, skipping request");
+        check_firmware_update(client, 0u);
+        return 0;
+    }
+
     LOG_INF("Requesting firmware info");
     char topic[100];
     snprintf(topic, sizeof(topic), "v1/devices/me/attributes/request/%d",
-             firmware_request_id);
-    char keys[] = "{\"sharedKeys\" : "
-                  "\"fw_checksum,fw_checksum_algorithm,fw_size,fw_title,fw_"
-                  "version,fw_state\"}";
-    int rc = send_message(topic, keys);
+             client->firmware.request_id);
+    rc = send_message(client, topic, keys);
     if (rc < 0) {
         LOG_ERR("Failed to request firmware info: %d", rc);
     } else {
@@ -152,32 +239,71 @@ int request_firmware_info() {
     return rc;
 }
 
-int send_telemetry(char *payload) {
-    return send_message((char *)CONFIG_TB_PUBLISH_TOPIC, payload);
+int send_telemetry(struct tb_client *client, char *payload) {
+    return send_message(client, (char *)CONFIG_TB_PUBLISH_TOPIC, payload);
 }
 
 void process_firmware_chunk(const uint8_t *chunk, size_t chunk_size,
                             int chunk_num) {
-    LOG_INF("Processing firmware chunk %d with size %zu", chunk_num, chunk_size);
+    LOG_DBG("Processing firmware chunk %d with size %zu", chunk_num, chunk_size);
 }
 
-int get_firmware(int chunk_number) {
-    static char update_request_topic[256];
+int get_firmware(struct tb_client *client, int chunk_number) {
+    char update_request_topic[256];
     int ret;
 
-    ret = update_request_topic_name(update_request_topic, chunk_number);
+    ret = update_request_topic_name(client, update_request_topic, chunk_number);
     if (ret != 0) {
         LOG_ERR("Failed to update request topic name: %d", ret);
         return ret;
     }
-    static char payload[100];
-    snprintf(payload, sizeof(payload), "%d", firmware_chunk_size);
-    send_message(update_request_topic, payload);
+    char payload[16];
+    snprintf(payload, sizeof(payload), "%d", client->firmware.chunk_size);
+    send_message_on(firmware_client(client), update_request_topic, payload);
+    tb_latency_mark(&client->latency, TB_LATENCY_SEND);
 
     return 0;
 }
 
-int on_connect() {
+static uint32_t download_elapsed_ms(const struct tb_firmware *fw) {
+    return MAX((uint32_t)(k_uptime_get() - fw->download_start_ms), 1u);
+}
+
+static void log_download_progress(const struct tb_firmware *fw,
+                                  const char *what) {
+    uint32_t elapsed_ms = download_elapsed_ms(fw);
+
+    LOG_INF("%s: chunk %d/%d, %u B in %u ms (%u B/s)", what, fw->chunk_number,
+            fw->chunk_count, fw->download_bytes, elapsed_ms,
+            (uint32_t)(((uint64_t)fw->download_bytes * 1000u) / elapsed_ms));
+}
+
+void firmware_chunk_request_handler(struct tb_events *events) {
+    struct tb_client *client = CONTAINER_OF(events, struct tb_client, events);
+    struct tb_firmware *fw = &client->firmware;
+
+    if (fw->chunk_retries > CONFIG_TB_CHUNK_MAX_RETRIES) {
+        LOG_ERR("Chunk %d not received after %d retries, aborting download",
+                fw->chunk_number, CONFIG_TB_CHUNK_MAX_RETRIES);
+        fw->downloads_aborted++;
+        firmware_download_finished(client);
+        return;
+    }
+
+    if (fw->chunk_retries > 0) {
+        LOG_WRN("Chunk %d timed out, retry %d", fw->chunk_number,
+                fw->chunk_retries);
+    }
+
+    get_firmware(client, fw->chunk_number);
+    fw->chunk_retries++;
+
+    /* Re-armed on every request, replaced as soon as the chunk arrives. */
+    tb_event_schedule(events, TB_EVENT_CHUNK_REQUEST,
+                      K_MSEC(CONFIG_TB_CHUNK_TIMEOUT_MS));
+}
+
+int on_connect(struct tb_client *client) {
     int rc;
 
     struct mqtt_topic topics[] = {
@@ -200,7 +326,7 @@ int on_connect() {
         .message_id = 1u,
     };
 
-    rc = mqtt_subscribe(&client_ctx, &sub_list);
+    rc = mqtt_subscribe(&client->mqtt, &sub_list);
     if (rc != 0) {
         LOG_ERR("Subscribe to topics failed: %d", rc);
         return rc;
@@ -208,19 +334,19 @@ int on_connect() {
 
     LOG_INF("Subscribed to all topics successfully");
 
-    rc = send_telemetry(current_firmware_to_json());
+    rc = send_telemetry(client, current_firmware_to_json());
     if (rc != 0) {
         LOG_ERR("Failed to send telemetry data: %d", rc);
         return rc;
     }
 
-    rc = request_firmware_info();
+    rc = request_firmware_info(client);
     if (rc != 0) {
         LOG_ERR("Failed to request firmware info: %d", rc);
         return rc;
     }
 
-    rc = get_firmware(0);
+    rc = get_firmware(client, 0);
     if (rc != 0) {
         LOG_ERR("Failed to start firmware download: %d", rc);
         return rc;
@@ -229,33 +355,80 @@ int on_connect() {
     return 0;
 }
 
-ssize_t process_message(const struct mqtt_publish_param *pub, uint8_t *buff, size_t buff_len) {
+ssize_t process_message(struct tb_client *client,
+                        const struct mqtt_publish_param *pub, uint8_t *buff,
+                        size_t buff_len) {
+    struct tb_firmware *fw = &client->firmware;
     char update_response_topic[256];
-    snprintf(update_response_topic, sizeof(update_response_topic), "v2/fw/response/%d/chunk/", firmware_request_id);
-
-    LOG_INF("Message arrived on topic %.*s", pub->message.topic.topic.size, pub->message.topic.topic.utf8);
+    char topic[64];
+    snprintf(update_response_topic, sizeof(update_response_topic), "v2/fw/response/%d/chunk/", fw->request_id);
+
+    /* The topic is not terminated in the MQTT receive buffer. */
+    snprintf(topic, sizeof(topic), "%.*s", pub->message.topic.topic.size,
+             pub->message.topic.topic.utf8);
+
+    LOG_DBG("Message arrived on topic %s", topic);
+
+    if (0 == strncmp(topic, "v1/devices/me/attributes", 24)) {
+        int changed;
+
+        buff[buff_len] = '\0';
+
+        LOG_DBG("Payload: %s", buff);
+        LOG_DBG("Payload length: %d", buff_len);
+
+        if (pub->message.topic.topic.size == 24) {
+            changed = tb_attr_cache_apply_delta(&client->attrs, (char *)buff,
+                                                buff_len);
+            if ((changed > 0) && (changed & FIRMWARE_UPDATE_KEYS)) {
+                check_firmware_update(client, changed);
+            }
+        } else if (0 == strncmp(topic, ATTR_RESPONSE_TOPIC,
+                                strlen(ATTR_RESPONSE_TOPIC))) {
+            changed = tb_attr_cache_apply_response(&client->attrs, (char *)buff,
+                                                   buff_len);
+            if ((changed >= 0) && tb_attr_cache_complete(&client->attrs)) {
+                check_firmware_update(client, changed);
+            } else if (changed >= 0) {
+                /* The assigned firmware changed, fetch its other keys. */
+                request_firmware_info(client);
+            }
+        }
+    } else if (0 == strncmp(topic, update_response_topic, strlen(update_response_topic))) {
+        int request_id = -1;
+        int chunk_number = -1;
 
-    if (0 == strncmp(pub->message.topic.topic.utf8, "v1/devices/me/attributes", 24)) {
-        if (strstr(pub->message.topic.topic.utf8, "/response/") != NULL) {
-            buff[buff_len] = '\0';
+        tb_latency_mark(&client->latency, TB_LATENCY_DISPATCH);
+        LOG_DBG("Firmware chunk received");
 
-            LOG_INF("Payload: %s", buff);
-            LOG_INF("Payload length: %d", buff_len);
+        sscanf(topic, "v2/fw/response/%d/chunk/%d", &request_id, &chunk_number);
 
-            process_firmware_info((const char *)buff);  // Use the test payload inside the function
+        /* Late answer to a retried request, or to an aborted download. */
+        if (!fw->download_active || (request_id != fw->request_id) ||
+            (chunk_number != fw->chunk_number)) {
+            LOG_DBG("Ignoring chunk %d of request %d, waiting for chunk %d",
+                    chunk_number, request_id, fw->chunk_number);
+            return 0;
         }
-    } else if (0 == strncmp(pub->message.topic.topic.utf8, update_response_topic, strlen(update_response_topic))) {
-        LOG_INF("\n\nFirmware Chunk received!\n\n");
 
-        sscanf(pub->message.topic.topic.utf8, "v2/fw/response/%d/chunk/%d", &firmware_request_id, &chunk_number);
-
-        store_firmware_chunk(buff, chunk_number, buff_len);
-
-        if (chunk_number >= chunk_count) {
-            LOG_INF("Firmware download completed");
+        store_firmware_chunk(buff, fw->chunk_number, buff_len);
+        tb_latency_mark(&client->latency, TB_LATENCY_FLASH);
+        fw->chunk_retries = 0;
+        fw->download_bytes += buff_len;
+
+        if (fw->chunk_number >= fw->chunk_count) {
+            tb_event_cancel(&client->events, TB_EVENT_CHUNK_REQUEST);
+            firmware_download_finished(client);
+            fw->downloads_completed++;
+            fw->last_download_ms = download_elapsed_ms(fw);
+            log_download_progress(fw, "Firmware download completed");
         } else {
-            chunk_number++;
-            get_firmware(chunk_number);
+            if ((fw->chunk_number % CONFIG_TB_OTA_PROGRESS_CHUNKS) == 0) {
+                log_download_progress(fw, "Firmware download progress");
+            }
+
+            fw->chunk_number++;
+            tb_event_post(&client->events, TB_EVENT_CHUNK_REQUEST);
         }
     }
 
@@ -6,25 +6,47 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/net/mqtt.h>
 
-extern struct mqtt_client client_ctx;
-extern int firmware_request_id;
-extern int chunk_count;
-extern int chunk_number;
-extern int firmware_chunk_size;
-extern bool do_firmware_update;
+struct tb_client;
+struct tb_events;
 
-static char current_firmware_version[24]; 
-static char current_firmware_title[64];   
+/* Firmware download state of one client. */
+struct tb_firmware {
+    int request_id;
+    int chunk_count;
+    int chunk_number;
+    int chunk_size;
+    int chunk_retries;
+    int64_t download_start_ms;
+    uint32_t download_bytes;
+    bool download_active;
+    uint32_t downloads_completed;
+    uint32_t downloads_aborted;
+    uint32_t last_download_ms;
+};
 
-int request_firmware_info();
+/* Running firmware, defined in mqtt_firmware_update.c. */
+extern char current_firmware_version[24];
+extern char current_firmware_title[64];
+
+void firmware_init(struct tb_firmware *firmware);
+int request_firmware_info(struct tb_client *client);
+void firmware_update_reset(struct tb_client *client);
 void process_firmware_chunk(const uint8_t *data, size_t len, int chunk_num);
-int get_firmware(int chunk_number); // Add this line
-int update_request_topic_name(char *topic_name, int chunk_number);
-int send_message(char *topic, char *payload);
+int get_firmware(struct tb_client *client, int chunk_number);
+void firmware_chunk_request_handler(struct tb_events *events);
+void firmware_ota_open_handler(struct tb_events *events);
+void firmware_ota_connected_handler(struct tb_events *events);
+void firmware_ota_close_handler(struct tb_events *events);
+int update_request_topic_name(struct tb_client *client, char *topic_name,
+                              int chunk_number);
+int send_message(struct tb_client *client, char *topic, char *payload);
+int send_telemetry(struct tb_client *client, char *payload);
 char *current_firmware_to_json();
 int store_firmware_chunk(void *payload, int chunk_number, int chunk_len);
-ssize_t process_message(const struct mqtt_publish_param *pub, uint8_t *buff, size_t buff_len);
+ssize_t process_message(struct tb_client *client,
+                        const struct mqtt_publish_param *pub, uint8_t *buff,
+                        size_t buff_len);
 
-int on_connect();
+int on_connect(struct tb_client *client);
 
 #endif // MQTT_FIRMWARE_UPDATE_H
@@ -0,0 +1,391 @@
+/* Shared attributes cache.
+ *
+ * Keeps the last known value of the firmware shared attributes, merges the
+ * updates pushed by the server and, when CONFIG_TB_ATTR_CACHE_SETTINGS is
+ * enabled, persists them so that a reconnect (or a reboot) only requests the
+ * keys whose value is unknown. Every key carries a version, incremented each
+ * time its value changes.
+ */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "tb_attr_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <zephyr/data/json.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#if defined(CONFIG_TB_ATTR_CACHE_SETTINGS)
+#include <zephyr/settings/settings.h>
+#endif
+
+LOG_MODULE_DECLARE(tb, CONFIG_TB_LOG_LEVEL);
+
+#define ATTR_DELETED_MAX 16u
+#define ATTR_ALL_KEYS (BIT(TB_ATTR_COUNT) - 1u)
+/* Always asked again on a new session, the other keys follow them. */
+#define ATTR_REVALIDATE_KEYS (BIT(TB_ATTR_FW_VERSION) | BIT(TB_ATTR_FW_CHECKSUM))
+#define ATTR_SETTINGS_ROOT "tb/attr"
+
+/* Presence of a field is given by a non-NULL string (or fw_size >= 0), the
+ * decoded fields bitmask of json_obj_parse() does not cover nested objects.
+ */
+struct attr_values {
+    const char *fw_checksum;
+    const char *fw_checksum_algorithm;
+    int32_t fw_size;
+    const char *fw_title;
+    const char *fw_version;
+    const char *fw_state;
+    const char *deleted[ATTR_DELETED_MAX];
+    size_t deleted_len;
+};
+
+struct attr_response {
+    struct attr_values shared;
+};
+
+static const struct json_obj_descr attr_values_descr[] = {
+    JSON_OBJ_DESCR_PRIM(struct attr_values, fw_checksum, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_PRIM(struct attr_values, fw_checksum_algorithm, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_PRIM(struct attr_values, fw_size, JSON_TOK_NUMBER),
+    JSON_OBJ_DESCR_PRIM(struct attr_values, fw_title, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_PRIM(struct attr_values, fw_version, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_PRIM(struct attr_values, fw_state, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_ARRAY(struct attr_values, deleted, ATTR_DELETED_MAX,
+                         deleted_len, JSON_TOK_STRING),
+};
+
+static const struct json_obj_descr attr_response_descr[] = {
+    JSON_OBJ_DESCR_OBJECT(struct attr_response, shared, attr_values_descr),
+};
+
+static const char *const attr_names[TB_ATTR_COUNT] = {
+    [TB_ATTR_FW_CHECKSUM] = "fw_checksum",
+    [TB_ATTR_FW_CHECKSUM_ALGORITHM] = "fw_checksum_algorithm",
+    [TB_ATTR_FW_SIZE] = "fw_size",
+    [TB_ATTR_FW_TITLE] = "fw_title",
+    [TB_ATTR_FW_VERSION] = "fw_version",
+    [TB_ATTR_FW_STATE] = "fw_state",
+};
+
+#if defined(CONFIG_TB_ATTR_CACHE_SETTINGS)
+/* Target of the settings handler, the cache of the physical device. */
+static struct tb_attr_cache *persistent_cache;
+#endif
+
+static void attr_persist(struct tb_attr_cache *cache, enum tb_attr_key key) {
+#if defined(CONFIG_TB_ATTR_CACHE_SETTINGS)
+    char name[48];
+    int ret;
+
+    if (!cache->persist) {
+        return;
+    }
+
+    snprintf(name, sizeof(name), ATTR_SETTINGS_ROOT "/%s", attr_names[key]);
+
+    ret = settings_save_one(name, &cache->entries[key],
+                            sizeof(cache->entries[key]));
+    if (ret != 0) {
+        LOG_WRN("Failed to persist %s: %d", attr_names[key], ret);
+    }
+#endif
+}
+
+/* Return the key bit if its value changed. */
+static uint32_t attr_set(struct tb_attr_cache *cache, enum tb_attr_key key,
+                         const char *value) {
+    struct tb_attr_entry *entry = &cache->entries[key];
+
+    cache->known |= BIT(key);
+    cache->stale &= ~BIT(key);
+
+    if (strncmp(entry->value, value, sizeof(entry->value) - 1u) == 0) {
+        return 0u;
+    }
+
+    strncpy(entry->value, value, sizeof(entry->value) - 1u);
+    entry->value[sizeof(entry->value) - 1u] = '\0';
+    entry->version++;
+
+    LOG_DBG("Attribute %s = \"%s\" (v%u)", attr_names[key], entry->value,
+            entry->version);
+
+    attr_persist(cache, key);
+
+    return BIT(key);
+}
+
+/* Merge the fields present in values, return the changed keys. */
+static uint32_t attr_merge(struct tb_attr_cache *cache,
+                           const struct attr_values *values,
+                           uint32_t *present) {
+    const char *incoming[TB_ATTR_COUNT] = {
+        [TB_ATTR_FW_CHECKSUM] = values->fw_checksum,
+        [TB_ATTR_FW_CHECKSUM_ALGORITHM] = values->fw_checksum_algorithm,
+        [TB_ATTR_FW_TITLE] = values->fw_title,
+        [TB_ATTR_FW_VERSION] = values->fw_version,
+        [TB_ATTR_FW_STATE] = values->fw_state,
+    };
+    char size_str[12];
+    uint32_t changed = 0u;
+    int i;
+
+    *present = 0u;
+
+    if (values->fw_size >= 0) {
+        snprintf(size_str, sizeof(size_str), "%d", values->fw_size);
+        incoming[TB_ATTR_FW_SIZE] = size_str;
+    }
+
+    for (i = 0; i < TB_ATTR_COUNT; i++) {
+        if (incoming[i] != NULL) {
+            *present |= BIT(i);
+            changed |= attr_set(cache, (enum tb_attr_key)i, incoming[i]);
+        }
+    }
+
+    return changed;
+}
+
+static void attr_values_init(struct attr_values *values) {
+    memset(values, 0, sizeof(*values));
+    values->fw_size = -1;
+}
+
+int tb_attr_cache_apply_response(struct tb_attr_cache *cache, char *json,
+                                 size_t len) {
+    struct attr_response response;
+    uint32_t changed;
+    uint32_t present;
+    int ret;
+    int i;
+
+    attr_values_init(&response.shared);
+
+    ret = json_obj_parse(json, len, attr_response_descr,
+                         ARRAY_SIZE(attr_response_descr), &response);
+    if (ret < 0) {
+        LOG_ERR("JSON Parse Error: %d", ret);
+        return ret;
+    }
+
+    changed = attr_merge(cache, &response.shared, &present);
+
+    /* Requested but not returned: the attribute is not set on the server. */
+    for (i = 0; i < TB_ATTR_COUNT; i++) {
+        if ((cache->requested & BIT(i)) && !(present & BIT(i))) {
+            changed |= attr_set(cache, (enum tb_attr_key)i, "");
+        }
+    }
+    cache->requested = 0u;
+
+    /* Another firmware was assigned meanwhile: the rest of the cached keys
+     * belong to the previous one and must be fetched too.
+     */
+    if (changed & ATTR_REVALIDATE_KEYS) {
+        cache->known &= ~cache->stale;
+    }
+    cache->stale = 0u;
+
+    cache->pending_changed |= changed;
+    if (!tb_attr_cache_complete(cache)) {
+        return 0;
+    }
+
+    changed = cache->pending_changed;
+    cache->pending_changed = 0u;
+
+    return changed;
+}
+
+int tb_attr_cache_apply_delta(struct tb_attr_cache *cache, char *json,
+                              size_t len) {
+    struct attr_values values;
+    uint32_t changed;
+    uint32_t present;
+    size_t d;
+    int ret;
+    int i;
+
+    attr_values_init(&values);
+
+    ret = json_obj_parse(json, len, attr_values_descr,
+                         ARRAY_SIZE(attr_values_descr), &values);
+    if (ret < 0) {
+        LOG_ERR("JSON Parse Error: %d", ret);
+        return ret;
+    }
+
+    changed = attr_merge(cache, &values, &present);
+
+    for (d = 0u; d < values.deleted_len; d++) {
+        for (i = 0; i < TB_ATTR_COUNT; i++) {
+            if (strcmp(values.deleted[d], attr_names[i]) == 0) {
+                changed |= attr_set(cache, (enum tb_attr_key)i, "");
+            }
+        }
+    }
+
+    /* Reported with the response completing the cache. */
+    if (!tb_attr_cache_complete(cache)) {
+        cache->pending_changed |= changed;
+        return 0;
+    }
+
+    return changed;
+}
+
+int tb_attr_cache_build_request(struct tb_attr_cache *cache, char *buf,
+                                size_t len) {
+    uint32_t unknown = (ATTR_ALL_KEYS & ~cache->known) |
+                       (cache->stale & ATTR_REVALIDATE_KEYS);
+    size_t used;
+    int ret;
+    int i;
+
+    if (unknown == 0u) {
+        return 0;
+    }
+
+    ret = snprintf(buf, len, "{\"sharedKeys\":\"");
+    if ((ret < 0) || ((size_t)ret >= len)) {
+        return -ENOMEM;
+    }
+    used = ret;
+
+    for (i = 0; i < TB_ATTR_COUNT; i++) {
+        if (!(unknown & BIT(i))) {
+            continue;
+        }
+
+        ret = snprintf(&buf[used], len - used, "%s%s",
+                       (unknown & (BIT(i) - 1u)) ? "," : "", attr_names[i]);
+        if ((ret < 0) || ((size_t)ret >= len - used)) {
+            return -ENOMEM;
+        }
+        used += ret;
+    }
+
+    ret = snprintf(&buf[used], len - used, "\"}");
+    if ((ret < 0) || ((size_t)ret >= len - used)) {
+        return -ENOMEM;
+    }
+
+    cache->requested = unknown;
+
+    return used + ret;
+}
+
+void tb_attr_cache_invalidate(struct tb_attr_cache *cache) {
+    cache->known = 0u;
+    cache->stale = 0u;
+    cache->pending_changed = 0u;
+}
+
+void tb_attr_cache_revalidate(struct tb_attr_cache *cache) {
+    cache->stale = cache->known;
+}
+
+bool tb_attr_cache_complete(const struct tb_attr_cache *cache) {
+    return (cache->known & ATTR_ALL_KEYS) == ATTR_ALL_KEYS;
+}
+
+const char *tb_attr_get(const struct tb_attr_cache *cache,
+                        enum tb_attr_key key) {
+    __ASSERT_NO_MSG(key < TB_ATTR_COUNT);
+
+    return cache->entries[key].value;
+}
+
+uint32_t tb_attr_version(const struct tb_attr_cache *cache,
+                         enum tb_attr_key key) {
+    __ASSERT_NO_MSG(key < TB_ATTR_COUNT);
+
+    return cache->entries[key].version;
+}
+
+#if defined(CONFIG_TB_ATTR_CACHE_SETTINGS)
+
+static int attr_settings_set(const char *name, size_t len,
+                             settings_read_cb read_cb, void *cb_arg) {
+    struct tb_attr_cache *cache = persistent_cache;
+    int i;
+    ssize_t ret;
+
+    if (cache == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < TB_ATTR_COUNT; i++) {
+        struct tb_attr_entry *entry = &cache->entries[i];
+
+        if (!settings_name_steq(name, attr_names[i], NULL)) {
+            continue;
+        }
+
+        if (len != sizeof(*entry)) {
+            return -EINVAL;
+        }
+
+        ret = read_cb(cb_arg, entry, sizeof(*entry));
+        if (ret < 0) {
+            return ret;
+        }
+
+        entry->value[TB_ATTR_VALUE_LEN - 1u] = '\0';
+        cache->known |= BIT(i);
+
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(tb_attr, ATTR_SETTINGS_ROOT, NULL,
+                               attr_settings_set, NULL, NULL);
+
+#endif
+
+int tb_attr_cache_init(struct tb_attr_cache *cache, bool persist) {
+    memset(cache, 0, sizeof(*cache));
+
+#if defined(CONFIG_TB_ATTR_CACHE_SETTINGS)
+    int ret;
+
+    if (!persist) {
+        return 0;
+    }
+
+    if (persistent_cache != NULL) {
+        LOG_ERR("Attributes cache already persisted");
+        return -EALREADY;
+    }
+
+    cache->persist = true;
+    persistent_cache = cache;
+
+    ret = settings_subsys_init();
+    if (ret != 0) {
+        LOG_ERR("Failed to initialize settings: %d", ret);
+        return ret;
+    }
+
+    ret = settings_load_subtree(ATTR_SETTINGS_ROOT);
+    if (ret != 0) {
+        LOG_ERR("Failed to load cached attributes: %d", ret);
+        return ret;
+    }
+
+    LOG_INF("Loaded %u cached attribute(s)", (uint32_t)__builtin_popcount(cache->known));
+#endif
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+/* Shared attributes cache. */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __TB_ATTR_CACHE_H__
+#define __TB_ATTR_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Same order as the JSON descriptor in tb_attr_cache.c. */
+enum tb_attr_key {
+    TB_ATTR_FW_CHECKSUM,
+    TB_ATTR_FW_CHECKSUM_ALGORITHM,
+    TB_ATTR_FW_SIZE,
+    TB_ATTR_FW_TITLE,
+    TB_ATTR_FW_VERSION,
+    TB_ATTR_FW_STATE,
+    TB_ATTR_COUNT,
+};
+
+#define TB_ATTR_VALUE_LEN 72u
+
+struct tb_attr_entry {
+    uint32_t version;
+    char value[TB_ATTR_VALUE_LEN];
+};
+
+struct tb_attr_cache {
+    struct tb_attr_entry entries[TB_ATTR_COUNT];
+    uint32_t known;
+    /* Cached before the current session, to be confirmed by the server. */
+    uint32_t stale;
+    uint32_t requested;
+    /* Changes of a response cycle not reported yet, see apply_response. */
+    uint32_t pending_changed;
+    bool persist;
+};
+
+/**
+ * Clear the cache. With persist (and CONFIG_TB_ATTR_CACHE_SETTINGS), load
+ * it from settings and store every change there. Only one cache can be
+ * persisted.
+ */
+int tb_attr_cache_init(struct tb_attr_cache *cache, bool persist);
+
+/**
+ * Merge an attributes request response: {"shared":{...}}. Requested keys
+ * missing from the response are known to be unset on the server. If a
+ * revalidated key changed, the other stale keys become unknown and must be
+ * requested again before the cache is complete.
+ *
+ * @return Bitmask of the keys changed since the cache was last complete, 0
+ *         while it is incomplete, negative on error.
+ */
+int tb_attr_cache_apply_response(struct tb_attr_cache *cache, char *json,
+                                 size_t len);
+
+/**
+ * Merge an attributes update pushed on the subscription topic: {...} with
+ * the changed keys, or {"deleted":[...]}.
+ *
+ * @return Bitmask of the keys whose value changed, 0 while the cache is
+ *         incomplete, negative on error.
+ */
+int tb_attr_cache_apply_delta(struct tb_attr_cache *cache, char *json,
+                              size_t len);
+
+/**
+ * Build the request payload for the keys whose value is unknown, plus
+ * fw_version and fw_checksum when stale, and mark them as requested.
+ *
+ * @return Payload length, 0 if every key is known, negative on error.
+ */
+int tb_attr_cache_build_request(struct tb_attr_cache *cache, char *buf,
+                                size_t len);
+
+/**
+ * Forget every value, the next request fetches all keys again.
+ */
+void tb_attr_cache_invalidate(struct tb_attr_cache *cache);
+
+/**
+ * Mark every cached value as stale, on a new session: pushes sent while the
+ * device was offline are not replayed by the server.
+ */
+void tb_attr_cache_revalidate(struct tb_attr_cache *cache);
+
+/**
+ * True when every key has a value, confirmed since the last revalidation.
+ */
+bool tb_attr_cache_complete(const struct tb_attr_cache *cache);
+
+/**
+ * Value of a key, empty string if unset or unknown.
+ */
+const char *tb_attr_get(const struct tb_attr_cache *cache,
+                        enum tb_attr_key key);
+
+uint32_t tb_attr_version(const struct tb_attr_cache *cache,
+                         enum tb_attr_key key);
+
+#endif
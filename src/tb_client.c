@@ -0,0 +1,599 @@
+/* ThingsBoard device client.
+ *
+ * MQTT session, telemetry and event handlers of a single device. Every
+ * piece of state lives in struct tb_client, so that the physical device
+ * runs one instance and the fleet simulator runs hundreds of them.
+ */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "tb_client.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <zephyr/data/json.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/tls_credentials.h>
+#if defined(CONFIG_MBEDTLS_MEMORY_DEBUG)
+#include <mbedtls/memory_buffer_alloc.h>
+#endif
+#if defined(CONFIG_TB_TLS_PROFILE_LEAN)
+#include <mbedtls/ssl_ciphersuites.h>
+#endif
+
+LOG_MODULE_DECLARE(tb, CONFIG_TB_LOG_LEVEL);
+
+#define MAX_RETRIES 10u
+#define BACKOFF_CONST_MS 5000u
+
+#define TELEMETRY_STATS_WINDOW 10u
+
+#define FW_RESPONSE_TOPIC "v2/fw/response/"
+
+#if defined(CONFIG_TB_TRANSPORT_TLS)
+static const sec_tag_t sec_tls_tags[] = {
+    TLS_TAG_DEVICE_CERTIFICATE,
+    TLS_TAG_TB_CA_CERTIFICATE,
+};
+
+#if defined(CONFIG_TB_TLS_PROFILE_LEAN)
+static const int tls_cipher_list[] = {
+#if defined(CONFIG_TB_TLS_LEAN_ECDHE_RSA)
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+#else
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+#endif
+};
+#endif
+#endif
+
+static int subscribe_to_topics(struct tb_client *client) {
+    int ret;
+    struct mqtt_topic topics[] = {
+        {.topic = {.utf8 = CONFIG_TB_SUBSCRIBE_TOPIC,
+                   .size = strlen(CONFIG_TB_SUBSCRIBE_TOPIC)},
+         .qos = MQTT_QOS_1_AT_LEAST_ONCE},
+        {.topic = {.utf8 = "v1/devices/me/attributes/response/+",
+                   .size = strlen("v1/devices/me/attributes/response/+")},
+         .qos = MQTT_QOS_1_AT_LEAST_ONCE},
+        {.topic = {.utf8 = "v2/fw/response/+",
+                   .size = strlen("v2/fw/response/+")},
+         .qos = MQTT_QOS_1_AT_LEAST_ONCE},
+        {.topic = {.utf8 = "v2/fw/response/+/chunk/+",
+                   .size = strlen("v2/fw/response/+/chunk/+")},
+         .qos = MQTT_QOS_1_AT_LEAST_ONCE}
+    };
+    const struct mqtt_subscription_list sub_list = {
+        .list = topics,
+        .list_count = ARRAY_SIZE(topics),
+        .message_id = 1u,
+    };
+
+    LOG_INF("Subscribing to %hu topic(s)", sub_list.list_count);
+
+    ret = mqtt_subscribe(&client->mqtt, &sub_list);
+    if (ret != 0) {
+        LOG_ERR("Failed to subscribe to topics: %d", ret);
+    }
+
+    return ret;
+}
+
+static void telemetry_acked(struct tb_client *client, uint16_t message_id) {
+    struct tb_telemetry_stats *telemetry = &client->telemetry;
+    uint32_t latency_ms;
+    uint32_t window_ms;
+
+    if ((telemetry->sent_ms == 0) || (message_id != telemetry->pending_id)) {
+        return;
+    }
+
+    latency_ms = (uint32_t)(k_uptime_get() - telemetry->sent_ms);
+    telemetry->sent_ms = 0;
+    telemetry->acked++;
+    telemetry->bytes += telemetry->pending_len;
+    telemetry->total_latency_ms += latency_ms;
+    telemetry->max_latency_ms = MAX(telemetry->max_latency_ms, latency_ms);
+
+    if (telemetry->acked < TELEMETRY_STATS_WINDOW) {
+        return;
+    }
+
+    window_ms = MAX((uint32_t)(k_uptime_get() - telemetry->window_start_ms), 1u);
+
+    LOG_INF("Telemetry: %u acked, ack latency avg %u ms max %u ms (%u B/s)",
+            telemetry->acked, telemetry->total_latency_ms / telemetry->acked,
+            telemetry->max_latency_ms,
+            (uint32_t)(((uint64_t)telemetry->bytes * 1000u) / window_ms));
+
+    memset(telemetry, 0, sizeof(*telemetry));
+    telemetry->window_start_ms = k_uptime_get();
+}
+
+static int publish_message(struct tb_client *client, const char *topic,
+                           size_t topic_len, uint8_t *payload,
+                           size_t payload_len) {
+    int ret;
+    struct mqtt_publish_param msg;
+
+    msg.retain_flag = 0u;
+    msg.message.topic.topic.utf8 = topic;
+    msg.message.topic.topic.size = topic_len;
+    msg.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
+    msg.message.payload.data = payload;
+    msg.message.payload.len = payload_len;
+    msg.message_id = client->next_message_id++;
+
+    ret = mqtt_publish(&client->mqtt, &msg);
+    if (ret != 0) {
+        LOG_ERR("Failed to publish message: %d", ret);
+    } else {
+        client->telemetry.pending_id = msg.message_id;
+        client->telemetry.pending_len = payload_len;
+        client->telemetry.sent_ms = k_uptime_get();
+    }
+
+    LOG_DBG("PUBLISHED on topic \"%s\" [ id: %u qos: %u ], payload: %zu B", topic,
+            msg.message_id, msg.message.topic.qos, payload_len);
+    LOG_HEXDUMP_DBG(payload, payload_len, "Published payload:");
+
+    return ret;
+}
+
+static ssize_t handle_published_message(struct tb_client *client,
+                                        const struct mqtt_publish_param *pub) {
+    int ret;
+    uint8_t *buffer = client->buffer;
+    size_t received = 0u;
+    const size_t message_size = pub->message.payload.len;
+    const bool discarded = message_size > TB_CLIENT_APP_BUFFER_SIZE;
+
+    tb_latency_mark(&client->latency, TB_LATENCY_INPUT);
+
+    LOG_DBG("RECEIVED on topic \"%s\" [ id: %u qos: %u ] payload: %u / %u B",
+            (const char *)pub->message.topic.topic.utf8, pub->message_id,
+            pub->message.topic.qos, message_size, TB_CLIENT_APP_BUFFER_SIZE);
+
+     while (received < message_size) {
+        uint8_t *p = discarded ? buffer : &buffer[received];
+
+        ret = mqtt_read_publish_payload_blocking(&client->mqtt, p,
+                                                 TB_CLIENT_APP_BUFFER_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+
+        received += ret;
+    }
+
+    tb_latency_mark(&client->latency, TB_LATENCY_COPY);
+
+    if (discarded) {
+        LOG_ERR("Payload of %u B discarded, larger than %u B",
+                (uint32_t)message_size, TB_CLIENT_APP_BUFFER_SIZE);
+        return -ENOMEM;
+    }
+
+    LOG_HEXDUMP_DBG(buffer, MIN(message_size, 256u), "Received payload:");
+
+    process_message(client, pub, buffer, message_size);
+
+    return 0;
+}
+
+static bool is_firmware_chunk(const struct mqtt_publish_param *pub) {
+    const struct mqtt_utf8 *topic = &pub->message.topic.topic;
+
+    return (topic->size > strlen(FW_RESPONSE_TOPIC)) &&
+           (memcmp(topic->utf8, FW_RESPONSE_TOPIC,
+                   strlen(FW_RESPONSE_TOPIC)) == 0);
+}
+
+const char *mqtt_evt_type_to_str(enum mqtt_evt_type type) {
+    static const char *const types[] = {
+        "CONNACK", "DISCONNECT", "PUBLISH", "PUBACK",   "PUBREC",
+        "PUBREL",  "PUBCOMP",    "SUBACK",  "UNSUBACK", "PINGRESP",
+    };
+
+    return (type < ARRAY_SIZE(types)) ? types[type] : "<unknown>";
+}
+
+static void mqtt_event_cb(struct mqtt_client *mqtt,
+                          const struct mqtt_evt *evt) {
+    struct tb_client *client = CONTAINER_OF(mqtt, struct tb_client, mqtt);
+
+    LOG_DBG("MQTT event: %s [%u] result: %d", mqtt_evt_type_to_str(evt->type),
+            evt->type, evt->result);
+
+    switch (evt->type) {
+        case MQTT_EVT_CONNACK: {
+            client->connected = true;
+            client->connections++;
+            if (client->connected_cb != NULL) {
+                client->connected_cb(client);
+            }
+            tb_event_post(&client->events, TB_EVENT_SUBSCRIBE);
+        } break;
+
+        case MQTT_EVT_PUBLISH: {
+            const struct mqtt_publish_param *pub = &evt->param.publish;
+
+            handle_published_message(client, pub);
+            client->messages_received++;
+            /* Chunks leave the telemetry periodic, as on the OTA session. */
+            if (!is_firmware_chunk(pub)) {
+                tb_event_post(&client->events, TB_EVENT_PUBLISH);
+            }
+        } break;
+
+        case MQTT_EVT_SUBACK: {
+            tb_event_post(&client->events, TB_EVENT_PUBLISH);
+        } break;
+
+        case MQTT_EVT_PUBACK: {
+            telemetry_acked(client, evt->param.puback.message_id);
+        } break;
+
+        case MQTT_EVT_DISCONNECT: {
+            client->connected = false;
+        } break;
+
+        case MQTT_EVT_PUBREC:
+        case MQTT_EVT_PUBREL:
+        case MQTT_EVT_PUBCOMP:
+        case MQTT_EVT_PINGRESP:
+        case MQTT_EVT_UNSUBACK:
+        default:
+            break;
+    }
+}
+
+static void tb_client_setup(struct tb_client *client) {
+    struct mqtt_client *client_ctx = &client->mqtt;
+
+    mqtt_client_init(client_ctx);
+
+    client_ctx->broker = client->broker;
+    client_ctx->evt_cb = mqtt_event_cb;
+    client_ctx->client_id.utf8 = (uint8_t *)client->name;
+    client_ctx->client_id.size = strlen(client->name);
+    client_ctx->password = NULL;
+    client_ctx->user_name = (client->token[0] != '\0') ? &client->user_name
+                                                       : NULL;
+    client_ctx->keepalive = CONFIG_MQTT_KEEPALIVE;
+    client_ctx->protocol_version = MQTT_VERSION_3_1_1;
+
+    client_ctx->rx_buf = client->rx_buffer;
+    client_ctx->rx_buf_size = TB_CLIENT_MQTT_BUFFER_SIZE;
+    client_ctx->tx_buf = client->tx_buffer;
+    client_ctx->tx_buf_size = TB_CLIENT_MQTT_BUFFER_SIZE;
+
+#if defined(CONFIG_TB_TRANSPORT_TLS)
+    client_ctx->transport.type = MQTT_TRANSPORT_SECURE;
+    struct mqtt_sec_config *const tls_config = &client_ctx->transport.tls.config;
+
+    tls_config->peer_verify = TLS_PEER_VERIFY_REQUIRED;
+#if defined(CONFIG_TB_TLS_PROFILE_LEAN)
+    tls_config->cipher_list = tls_cipher_list;
+    tls_config->cipher_count = ARRAY_SIZE(tls_cipher_list);
+#else
+    tls_config->cipher_list = NULL;
+#endif
+    tls_config->sec_tag_list = sec_tls_tags;
+    tls_config->sec_tag_count = ARRAY_SIZE(sec_tls_tags);
+    tls_config->hostname = CONFIG_TB_ENDPOINT;
+    tls_config->cert_nocopy = TLS_CERT_NOCOPY_NONE;
+#else
+    client_ctx->transport.type = MQTT_TRANSPORT_NON_SECURE;
+#endif
+}
+
+struct backoff_context {
+    uint16_t retries_count;
+    uint16_t max_retries;
+};
+
+static void backoff_context_init(struct backoff_context *bo) {
+    __ASSERT_NO_MSG(bo != NULL);
+
+    bo->retries_count = 0u;
+    bo->max_retries = MAX_RETRIES;
+}
+
+static void backoff_get_next(struct backoff_context *bo,
+                             uint32_t *next_backoff_ms) {
+    __ASSERT_NO_MSG(bo != NULL);
+    __ASSERT_NO_MSG(next_backoff_ms != NULL);
+
+    *next_backoff_ms = BACKOFF_CONST_MS;
+}
+
+#if defined(CONFIG_TB_TRANSPORT_TLS)
+/* Connect, logging the TCP + TLS handshake cost for profile comparison. */
+static int tls_measured_connect(struct tb_client *client) {
+    int ret;
+    int64_t start_ms = k_uptime_get();
+#if defined(CONFIG_THREAD_RUNTIME_STATS)
+    k_thread_runtime_stats_t cpu_start, cpu_end;
+
+    k_thread_runtime_stats_get(k_current_get(), &cpu_start);
+#endif
+#if defined(CONFIG_MBEDTLS_MEMORY_DEBUG)
+    size_t heap_peak, heap_blocks;
+
+    mbedtls_memory_buffer_alloc_max_reset();
+#endif
+
+    ret = mqtt_connect(&client->mqtt);
+    if (ret != 0) {
+        return ret;
+    }
+
+    LOG_INF("TLS handshake: %u ms", (uint32_t)(k_uptime_get() - start_ms));
+#if defined(CONFIG_THREAD_RUNTIME_STATS)
+    k_thread_runtime_stats_get(k_current_get(), &cpu_end);
+    LOG_INF("TLS handshake CPU: %u us",
+            (uint32_t)k_cyc_to_us_floor64(cpu_end.execution_cycles -
+                                          cpu_start.execution_cycles));
+#endif
+#if defined(CONFIG_MBEDTLS_MEMORY_DEBUG)
+    mbedtls_memory_buffer_alloc_max_get(&heap_peak, &heap_blocks);
+    LOG_INF("TLS handshake heap peak: %zu B", heap_peak);
+#endif
+
+    return 0;
+}
+#endif
+
+static int tb_client_try_connect(struct tb_client *client) {
+    int ret;
+    uint32_t backoff_ms;
+    struct backoff_context bo;
+
+    backoff_context_init(&bo);
+
+    while (bo.retries_count <= bo.max_retries) {
+#if defined(CONFIG_TB_TRANSPORT_TLS)
+        ret = tls_measured_connect(client);
+#else
+        ret = mqtt_connect(&client->mqtt);
+#endif
+        if (ret == 0) {
+            goto exit;
+        }
+
+        backoff_get_next(&bo, &backoff_ms);
+
+        LOG_ERR("Failed to connect: %d backoff delay: %u ms", ret, backoff_ms);
+        k_msleep(backoff_ms);
+    }
+
+exit:
+    return ret;
+}
+
+struct publish_payload {
+    uint32_t counter;
+};
+
+static const struct json_obj_descr json_descr[] = {
+    JSON_OBJ_DESCR_PRIM(struct publish_payload, counter, JSON_TOK_NUMBER),
+};
+
+static int publish(struct tb_client *client) {
+    struct publish_payload pl = {.counter = client->messages_received};
+
+    json_obj_encode_buf(json_descr, ARRAY_SIZE(json_descr), &pl,
+                        (char *)client->buffer, sizeof(client->buffer));
+
+    return publish_message(client, CONFIG_TB_PUBLISH_TOPIC,
+                           strlen(CONFIG_TB_PUBLISH_TOPIC), client->buffer,
+                           strlen((char *)client->buffer));
+}
+
+static void on_subscribe_event(struct tb_events *events) {
+    struct tb_client *client = CONTAINER_OF(events, struct tb_client, events);
+
+    subscribe_to_topics(client);
+
+    /* A download interrupted by the disconnection starts over. */
+    firmware_update_reset(client);
+
+    /* Updates pushed while disconnected are lost, confirm the cache. */
+    tb_attr_cache_revalidate(&client->attrs);
+    request_firmware_info(client);
+
+    if (CONFIG_TB_ATTR_REFRESH_SEC > 0) {
+        tb_event_schedule(events, TB_EVENT_ATTR_REFRESH,
+                          K_SECONDS(CONFIG_TB_ATTR_REFRESH_SEC));
+    }
+
+#if defined(CONFIG_TB_LATENCY_TRACE)
+    if (CONFIG_TB_LATENCY_PUBLISH_SEC > 0) {
+        tb_event_schedule(events, TB_EVENT_DIAGNOSTICS,
+                          K_SECONDS(CONFIG_TB_LATENCY_PUBLISH_SEC));
+    }
+#endif
+}
+
+static void on_publish_event(struct tb_events *events) {
+    struct tb_client *client = CONTAINER_OF(events, struct tb_client, events);
+
+    publish(client);
+
+    /* Any publish restarts the telemetry period. */
+    if (CONFIG_TB_TELEMETRY_PERIOD_SEC > 0) {
+        tb_event_schedule(events, TB_EVENT_PUBLISH,
+                          K_SECONDS(CONFIG_TB_TELEMETRY_PERIOD_SEC));
+    }
+}
+
+#if defined(CONFIG_TB_LATENCY_TRACE)
+static void on_diagnostics_event(struct tb_events *events) {
+    struct tb_client *client = CONTAINER_OF(events, struct tb_client, events);
+    int len;
+
+    /* Handlers run between two inputs, the receive buffer is free. */
+    len = tb_latency_to_json((char *)client->buffer, sizeof(client->buffer));
+    if (len > 0) {
+        publish_message(client, CONFIG_TB_PUBLISH_TOPIC,
+                        strlen(CONFIG_TB_PUBLISH_TOPIC), client->buffer, len);
+    }
+
+    tb_event_schedule(events, TB_EVENT_DIAGNOSTICS,
+                      K_SECONDS(CONFIG_TB_LATENCY_PUBLISH_SEC));
+}
+#endif
+
+static void on_attr_refresh_event(struct tb_events *events) {
+    struct tb_client *client = CONTAINER_OF(events, struct tb_client, events);
+
+    /* Periodic full resync, in case a pushed update was missed. */
+    tb_attr_cache_invalidate(&client->attrs);
+    request_firmware_info(client);
+
+    tb_event_schedule(events, TB_EVENT_ATTR_REFRESH,
+                      K_SECONDS(CONFIG_TB_ATTR_REFRESH_SEC));
+}
+
+int tb_client_init(struct tb_client *client, const struct sockaddr *broker,
+                   const char *name, const char *token, bool persist_attrs) {
+    struct tb_events *events = &client->events;
+    int ret;
+
+    memset(client, 0, sizeof(*client));
+
+    client->broker = broker;
+    client->next_message_id = 1u;
+    strncpy(client->name, name, sizeof(client->name) - 1u);
+    if (token != NULL) {
+        strncpy(client->token, token, sizeof(client->token) - 1u);
+    }
+    client->user_name.utf8 = (uint8_t *)client->token;
+    client->user_name.size = strlen(client->token);
+
+    firmware_init(&client->firmware);
+#if defined(CONFIG_TB_OTA_SESSION)
+    tb_ota_session_init(&client->ota, client);
+#endif
+
+    ret = tb_attr_cache_init(&client->attrs, persist_attrs);
+    if (ret != 0) {
+        LOG_WRN("Attributes cache not loaded: %d", ret);
+    }
+
+    ret = tb_events_init(events);
+    if (ret != 0) {
+        return ret;
+    }
+
+    tb_event_register(events, TB_EVENT_SUBSCRIBE, on_subscribe_event);
+    tb_event_register(events, TB_EVENT_PUBLISH, on_publish_event);
+    tb_event_register(events, TB_EVENT_CHUNK_REQUEST,
+                      firmware_chunk_request_handler);
+    tb_event_register(events, TB_EVENT_ATTR_REFRESH, on_attr_refresh_event);
+#if defined(CONFIG_TB_LATENCY_TRACE)
+    tb_event_register(events, TB_EVENT_DIAGNOSTICS, on_diagnostics_event);
+#endif
+#if defined(CONFIG_TB_OTA_SESSION)
+    tb_event_register(events, TB_EVENT_OTA_OPEN, firmware_ota_open_handler);
+    tb_event_register(events, TB_EVENT_OTA_CONNECTED,
+                      firmware_ota_connected_handler);
+    tb_event_register(events, TB_EVENT_OTA_CLOSE, firmware_ota_close_handler);
+#endif
+
+    return 0;
+}
+
+void tb_client_loop(struct tb_client *client) {
+    int rc;
+    int timeout;
+#if defined(CONFIG_TB_OTA_SESSION)
+    int ota_timeout;
+    struct zsock_pollfd fds[3];
+#else
+    struct zsock_pollfd fds[2];
+#endif
+
+    tb_client_setup(client);
+
+    rc = tb_client_try_connect(client);
+    if (rc != 0) {
+        goto cleanup;
+    }
+
+    fds[0].fd = client->mqtt.transport.tcp.sock;
+    fds[0].events = ZSOCK_POLLIN;
+    fds[1].fd = tb_events_fd(&client->events);
+    fds[1].events = ZSOCK_POLLIN;
+#if defined(CONFIG_TB_OTA_SESSION)
+    fds[2].events = ZSOCK_POLLIN;
+#endif
+
+    client->telemetry.window_start_ms = k_uptime_get();
+
+    for (;;) {
+        timeout = mqtt_keepalive_time_left(&client->mqtt);
+#if defined(CONFIG_TB_OTA_SESSION)
+        /* Opened and closed by event handlers, ignored by poll when < 0. */
+        fds[2].fd = tb_ota_session_fd(&client->ota);
+        ota_timeout = tb_ota_session_keepalive_time_left(&client->ota);
+        if (ota_timeout >= 0) {
+            timeout = MIN(timeout, ota_timeout);
+        }
+#endif
+        rc = zsock_poll(fds, ARRAY_SIZE(fds), timeout);
+        if (rc >= 0) {
+            if (fds[0].revents & ZSOCK_POLLIN) {
+                tb_latency_begin(&client->latency);
+                rc = mqtt_input(&client->mqtt);
+                if (rc != 0) {
+                    LOG_ERR("Failed to read MQTT input: %d", rc);
+                    break;
+                }
+            }
+
+            if (fds[0].revents & (ZSOCK_POLLHUP | ZSOCK_POLLERR)) {
+                LOG_ERR("Socket closed/error");
+                break;
+            }
+
+            rc = mqtt_live(&client->mqtt);
+            if ((rc != 0) && (rc != -EAGAIN)) {
+                LOG_ERR("Failed to live MQTT: %d", rc);
+                break;
+            }
+
+#if defined(CONFIG_TB_OTA_SESSION)
+            if (fds[2].fd >= 0) {
+                if (fds[2].revents & ZSOCK_POLLIN) {
+                    tb_latency_begin(&client->latency);
+                }
+                tb_ota_session_process(&client->ota, fds[2].revents);
+            }
+#endif
+        } else {
+            LOG_ERR("poll failed: %d", rc);
+            break;
+        }
+
+        tb_events_dispatch(&client->events);
+        tb_latency_end(&client->latency);
+    }
+
+cleanup:
+#if defined(CONFIG_TB_OTA_SESSION)
+    tb_ota_session_close(&client->ota);
+#endif
+    tb_events_cancel_all(&client->events);
+    tb_events_log_stats(&client->events);
+    client->connected = false;
+
+    /* Also closes the socket, unless the library already did on error. */
+    mqtt_disconnect(&client->mqtt);
+}
@@ -0,0 +1,100 @@
+/* ThingsBoard device client. */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __TB_CLIENT_H__
+#define __TB_CLIENT_H__
+
+#include "mqtt_firmware_update.h"
+#include "tb_attr_cache.h"
+#include "tb_events.h"
+#include "tb_latency.h"
+#if defined(CONFIG_TB_OTA_SESSION)
+#include "tb_ota_session.h"
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/net/mqtt.h>
+#include <zephyr/net/socket.h>
+
+#define TB_CLIENT_MQTT_BUFFER_SIZE 256u
+#define TB_CLIENT_APP_BUFFER_SIZE 4096u
+#define TB_CLIENT_NAME_LEN 48u
+
+#define TLS_TAG_DEVICE_CERTIFICATE 1
+#define TLS_TAG_DEVICE_PRIVATE_KEY 1
+#define TLS_TAG_TB_CA_CERTIFICATE 2
+
+/* Publish to PUBACK latency of the telemetry, summarized every
+ * TELEMETRY_STATS_WINDOW acknowledgements.
+ */
+struct tb_telemetry_stats {
+    uint16_t pending_id;
+    size_t pending_len;
+    int64_t sent_ms;
+    int64_t window_start_ms;
+    uint32_t acked;
+    uint32_t bytes;
+    uint32_t total_latency_ms;
+    uint32_t max_latency_ms;
+};
+
+/* All the state of one device, so that several can run side by side in the
+ * fleet simulator. Only touched from the thread running tb_client_loop(),
+ * except the events which can be posted from anywhere.
+ */
+struct tb_client {
+    struct mqtt_client mqtt;
+    const struct sockaddr *broker;
+    uint8_t rx_buffer[TB_CLIENT_MQTT_BUFFER_SIZE];
+    uint8_t tx_buffer[TB_CLIENT_MQTT_BUFFER_SIZE];
+    /* One extra byte for process_message() to terminate text payloads. */
+    uint8_t buffer[TB_CLIENT_APP_BUFFER_SIZE + 1];
+    char name[TB_CLIENT_NAME_LEN];
+    char token[TB_CLIENT_NAME_LEN];
+    struct mqtt_utf8 user_name;
+
+    uint32_t messages_received;
+    uint32_t next_message_id;
+    struct tb_telemetry_stats telemetry;
+
+    struct tb_events events;
+    struct tb_firmware firmware;
+    struct tb_attr_cache attrs;
+    struct tb_latency_window latency;
+#if defined(CONFIG_TB_OTA_SESSION)
+    struct tb_ota_session ota;
+#endif
+
+    bool connected;
+    uint32_t connections;
+    /* Called on every CONNACK, from the client thread. */
+    void (*connected_cb)(struct tb_client *client);
+};
+
+/**
+ * Initialize a client and register its event handlers.
+ *
+ * @param broker Resolved broker address, must outlive the client.
+ * @param name MQTT client id.
+ * @param token Access token sent as user name, NULL or empty to
+ *              authenticate with the TLS client certificate only.
+ * @param persist_attrs Persist the shared attributes cache, see
+ *                      tb_attr_cache_init().
+ */
+int tb_client_init(struct tb_client *client, const struct sockaddr *broker,
+                   const char *name, const char *token, bool persist_attrs);
+
+/**
+ * Connect and run the client until the connection is lost.
+ */
+void tb_client_loop(struct tb_client *client);
+
+const char *mqtt_evt_type_to_str(enum mqtt_evt_type type);
+
+#endif
@@ -0,0 +1,151 @@
+/* Client event scheduler.
+ *
+ * Events are posted from any thread (or from a delayable work item when a
+ * deadline expires) and always handled from the client thread, which waits on
+ * the MQTT socket and on an eventfd at the same time. This keeps every access
+ * to the MQTT client on a single thread while timers fire independently of
+ * socket activity.
+ */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "tb_events.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/logging/log.h>
+#include <zephyr/posix/sys/eventfd.h>
+
+LOG_MODULE_DECLARE(tb, CONFIG_TB_LOG_LEVEL);
+
+static const char *const event_names[TB_EVENT_COUNT] = {
+    [TB_EVENT_SUBSCRIBE] = "subscribe",
+    [TB_EVENT_PUBLISH] = "publish",
+    [TB_EVENT_CHUNK_REQUEST] = "chunk_request",
+    [TB_EVENT_ATTR_REFRESH] = "attr_refresh",
+    [TB_EVENT_DIAGNOSTICS] = "diagnostics",
+    [TB_EVENT_OTA_OPEN] = "ota_open",
+    [TB_EVENT_OTA_CONNECTED] = "ota_connected",
+    [TB_EVENT_OTA_CLOSE] = "ota_close",
+};
+
+static void timer_expired(struct k_work *work) {
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    struct tb_event_timer *timer =
+        CONTAINER_OF(dwork, struct tb_event_timer, work);
+
+    tb_event_post(timer->events, timer->evt);
+}
+
+int tb_events_init(struct tb_events *events) {
+    int i;
+
+    memset(events, 0, sizeof(*events));
+
+    events->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    if (events->wakeup_fd < 0) {
+        LOG_ERR("Failed to create event fd: %d", errno);
+        return -errno;
+    }
+
+    for (i = 0; i < TB_EVENT_COUNT; i++) {
+        events->timers[i].events = events;
+        events->timers[i].evt = (enum tb_event)i;
+        k_work_init_delayable(&events->timers[i].work, timer_expired);
+    }
+
+    return 0;
+}
+
+int tb_events_fd(const struct tb_events *events) {
+    return events->wakeup_fd;
+}
+
+void tb_event_register(struct tb_events *events, enum tb_event evt,
+                       tb_event_handler_t handler) {
+    __ASSERT_NO_MSG(evt < TB_EVENT_COUNT);
+
+    events->handlers[evt] = handler;
+}
+
+void tb_event_post(struct tb_events *events, enum tb_event evt) {
+    __ASSERT_NO_MSG(evt < TB_EVENT_COUNT);
+
+    /* Latency is measured from the first post, coalesced posts keep it. */
+    if (!atomic_test_and_set_bit(events->pending, evt)) {
+        events->posted_at[evt] = k_cycle_get_32();
+    }
+
+    eventfd_write(events->wakeup_fd, 1u);
+}
+
+void tb_event_schedule(struct tb_events *events, enum tb_event evt,
+                       k_timeout_t delay) {
+    __ASSERT_NO_MSG(evt < TB_EVENT_COUNT);
+
+    k_work_reschedule(&events->timers[evt].work, delay);
+}
+
+void tb_event_cancel(struct tb_events *events, enum tb_event evt) {
+    __ASSERT_NO_MSG(evt < TB_EVENT_COUNT);
+
+    k_work_cancel_delayable(&events->timers[evt].work);
+    atomic_clear_bit(events->pending, evt);
+}
+
+void tb_events_cancel_all(struct tb_events *events) {
+    int i;
+
+    for (i = 0; i < TB_EVENT_COUNT; i++) {
+        tb_event_cancel(events, (enum tb_event)i);
+    }
+}
+
+void tb_events_dispatch(struct tb_events *events) {
+    int i;
+    eventfd_t value;
+
+    /* Drain the wakeup counter, pending bits are the source of truth. */
+    (void)eventfd_read(events->wakeup_fd, &value);
+
+    for (i = 0; i < TB_EVENT_COUNT; i++) {
+        struct tb_event_stats *stats = &events->stats[i];
+
+        if (!atomic_test_and_clear_bit(events->pending, i)) {
+            continue;
+        }
+
+        uint32_t latency_us =
+            k_cyc_to_us_floor32(k_cycle_get_32() - events->posted_at[i]);
+
+        stats->count++;
+        stats->total_us += latency_us;
+        stats->max_us = MAX(stats->max_us, latency_us);
+
+        LOG_DBG("Event %s dispatched after %u us", event_names[i], latency_us);
+
+        if (events->handlers[i] != NULL) {
+            events->handlers[i](events);
+        }
+    }
+}
+
+void tb_events_log_stats(const struct tb_events *events) {
+    int i;
+
+    for (i = 0; i < TB_EVENT_COUNT; i++) {
+        const struct tb_event_stats *stats = &events->stats[i];
+
+        if (stats->count == 0u) {
+            continue;
+        }
+
+        LOG_INF("Event %s: %u dispatched, latency avg %u us max %u us",
+                event_names[i], stats->count,
+                (uint32_t)(stats->total_us / stats->count), stats->max_us);
+    }
+}
@@ -0,0 +1,87 @@
+/* Client event scheduler. */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __TB_EVENTS_H__
+#define __TB_EVENTS_H__
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+enum tb_event {
+    TB_EVENT_SUBSCRIBE,
+    TB_EVENT_PUBLISH,
+    TB_EVENT_CHUNK_REQUEST,
+    TB_EVENT_ATTR_REFRESH,
+    TB_EVENT_DIAGNOSTICS,
+    TB_EVENT_OTA_OPEN,
+    TB_EVENT_OTA_CONNECTED,
+    TB_EVENT_OTA_CLOSE,
+    TB_EVENT_COUNT,
+};
+
+struct tb_events;
+
+/* Handlers get back to their client with CONTAINER_OF(). */
+typedef void (*tb_event_handler_t)(struct tb_events *events);
+
+struct tb_event_timer {
+    struct k_work_delayable work;
+    struct tb_events *events;
+    enum tb_event evt;
+};
+
+struct tb_event_stats {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+struct tb_events {
+    int wakeup_fd;
+    ATOMIC_DEFINE(pending, TB_EVENT_COUNT);
+    uint32_t posted_at[TB_EVENT_COUNT];
+    tb_event_handler_t handlers[TB_EVENT_COUNT];
+    struct tb_event_timer timers[TB_EVENT_COUNT];
+    struct tb_event_stats stats[TB_EVENT_COUNT];
+};
+
+/**
+ * Create the wakeup descriptor, must be called before any other function.
+ */
+int tb_events_init(struct tb_events *events);
+
+/**
+ * File descriptor to poll alongside the MQTT socket, readable whenever an
+ * event is pending.
+ */
+int tb_events_fd(const struct tb_events *events);
+
+void tb_event_register(struct tb_events *events, enum tb_event evt,
+                       tb_event_handler_t handler);
+
+/**
+ * Mark an event as pending, it is handled on the next tb_events_dispatch().
+ */
+void tb_event_post(struct tb_events *events, enum tb_event evt);
+
+/**
+ * Post an event once the delay expires, replacing any previous deadline.
+ */
+void tb_event_schedule(struct tb_events *events, enum tb_event evt,
+                       k_timeout_t delay);
+
+void tb_event_cancel(struct tb_events *events, enum tb_event evt);
+void tb_events_cancel_all(struct tb_events *events);
+
+/**
+ * Run the handlers of all pending events, from the client thread.
+ */
+void tb_events_dispatch(struct tb_events *events);
+
+void tb_events_log_stats(const struct tb_events *events);
+
+#endif
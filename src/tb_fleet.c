@@ -0,0 +1,111 @@
+/* Simulated device fleet.
+ *
+ * Runs CONFIG_TB_FLEET_SIZE clients in one process, each on its own thread
+ * with its own MQTT session, access token and firmware download state. Meant
+ * for native_sim against scripts/fake_tb_server.py, to load test the server
+ * side of a firmware rollout and to catch client regressions which only
+ * show up with many devices (reconnect storms, chunk retries, timers).
+ */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "tb_fleet.h"
+
+#include "tb_client.h"
+
+#include <stdio.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+/* Aggregated reports stay visible when the per-device logs are filtered. */
+LOG_MODULE_REGISTER(tb_fleet, LOG_LEVEL_INF);
+
+#define FLEET_PRIORITY K_PRIO_PREEMPT(10)
+#define FLEET_RECONNECT_DELAY K_SECONDS(1)
+
+static struct tb_client fleet_clients[CONFIG_TB_FLEET_SIZE];
+static struct k_thread fleet_threads[CONFIG_TB_FLEET_SIZE];
+static K_THREAD_STACK_ARRAY_DEFINE(fleet_stacks, CONFIG_TB_FLEET_SIZE,
+                                   CONFIG_TB_FLEET_STACK_SIZE);
+
+static void fleet_device_thread(void *p1, void *p2, void *p3) {
+    struct tb_client *client = p1;
+
+    for (;;) {
+        tb_client_loop(client);
+        k_sleep(FLEET_RECONNECT_DELAY);
+    }
+}
+
+static void fleet_report(void) {
+    uint32_t connected = 0u;
+    uint32_t connections = 0u;
+    uint32_t downloading = 0u;
+    uint32_t completed = 0u;
+    uint32_t aborted = 0u;
+    uint32_t download_ms_max = 0u;
+    uint64_t download_ms_total = 0u;
+    uint32_t updated = 0u;
+    int i;
+
+    for (i = 0; i < CONFIG_TB_FLEET_SIZE; i++) {
+        const struct tb_client *client = &fleet_clients[i];
+        const struct tb_firmware *fw = &client->firmware;
+
+        connected += client->connected ? 1u : 0u;
+        connections += client->connections;
+        downloading += fw->download_active ? 1u : 0u;
+        completed += fw->downloads_completed;
+        aborted += fw->downloads_aborted;
+
+        if (fw->downloads_completed > 0u) {
+            updated++;
+            download_ms_total += fw->last_download_ms;
+            download_ms_max = MAX(download_ms_max, fw->last_download_ms);
+        }
+    }
+
+    LOG_INF("Fleet: %u/%u connected (%u connections), %u downloading",
+            connected, CONFIG_TB_FLEET_SIZE, connections, downloading);
+    LOG_INF("Fleet: %u downloads completed, %u aborted, duration avg %u ms "
+            "max %u ms",
+            completed, aborted,
+            (updated > 0u) ? (uint32_t)(download_ms_total / updated) : 0u,
+            download_ms_max);
+}
+
+void tb_fleet_run(const struct sockaddr *broker) {
+    char name[TB_CLIENT_NAME_LEN];
+    char token[TB_CLIENT_NAME_LEN];
+    int i;
+
+    LOG_INF("Starting %u simulated devices", CONFIG_TB_FLEET_SIZE);
+
+    for (i = 0; i < CONFIG_TB_FLEET_SIZE; i++) {
+        snprintf(name, sizeof(name), CONFIG_TB_THING_NAME "-%d", i);
+        snprintf(token, sizeof(token), CONFIG_TB_FLEET_TOKEN_PREFIX "%d", i);
+
+        if (tb_client_init(&fleet_clients[i], broker, name, token, false) != 0) {
+            LOG_ERR("Failed to initialize device %d", i);
+            continue;
+        }
+
+        k_thread_create(&fleet_threads[i], fleet_stacks[i],
+                        K_THREAD_STACK_SIZEOF(fleet_stacks[i]),
+                        fleet_device_thread, &fleet_clients[i], NULL, NULL,
+                        FLEET_PRIORITY, 0, K_NO_WAIT);
+        k_thread_name_set(&fleet_threads[i], fleet_clients[i].name);
+
+        /* Spread the connections instead of a single burst. */
+        k_msleep(CONFIG_TB_FLEET_RAMP_MS);
+    }
+
+    for (;;) {
+        k_sleep(K_SECONDS(CONFIG_TB_FLEET_REPORT_SEC));
+        fleet_report();
+    }
+}
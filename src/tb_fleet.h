@@ -0,0 +1,19 @@
+/* Simulated device fleet. */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __TB_FLEET_H__
+#define __TB_FLEET_H__
+
+#include <zephyr/net/socket.h>
+
+/**
+ * Start CONFIG_TB_FLEET_SIZE clients against the broker, then log the fleet
+ * statistics every CONFIG_TB_FLEET_REPORT_SEC. Does not return.
+ */
+void tb_fleet_run(const struct sockaddr *broker);
+
+#endif
@@ -0,0 +1,207 @@
+/* Hot path latency histograms.
+ *
+ * Every stage is accumulated in fixed power-of-two microsecond buckets, so
+ * recording is a cycle counter read and a few increments and can stay
+ * enabled in production. Histograms are shown by the "tb latency" shell
+ * command, emitted as tracing named events and optionally published as
+ * telemetry.
+ */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "tb_latency.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+#if defined(CONFIG_TRACING)
+#include <zephyr/tracing/tracing.h>
+#endif
+
+LOG_MODULE_DECLARE(tb, CONFIG_TB_LOG_LEVEL);
+
+/* Bucket i holds [2^i, 2^(i+1)) us, the last one everything above. */
+#define LATENCY_BUCKETS 20u
+
+struct latency_histogram {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+};
+
+static const char *const stage_names[TB_LATENCY_STAGE_COUNT] = {
+    [TB_LATENCY_INPUT] = "input",
+    [TB_LATENCY_COPY] = "copy",
+    [TB_LATENCY_DISPATCH] = "dispatch",
+    [TB_LATENCY_FLASH] = "flash",
+    [TB_LATENCY_SEND] = "send",
+    [TB_LATENCY_TOTAL] = "total",
+};
+
+static struct latency_histogram histograms[TB_LATENCY_STAGE_COUNT];
+static struct k_spinlock histograms_lock;
+
+static void histogram_add(struct latency_histogram *h, uint32_t us) {
+    uint32_t bucket = 31u - __builtin_clz(us | 1u);
+
+    h->buckets[MIN(bucket, LATENCY_BUCKETS - 1u)]++;
+    h->count++;
+    h->max_us = MAX(h->max_us, us);
+}
+
+/* Upper bound of the bucket holding the given percentile. */
+static uint32_t histogram_percentile(const struct latency_histogram *h,
+                                     uint32_t percent) {
+    uint32_t i;
+    uint32_t seen = 0u;
+    uint32_t rank = (uint32_t)(((uint64_t)h->count * percent + 99u) / 100u);
+
+    for (i = 0u; i < LATENCY_BUCKETS - 1u; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            return MIN(1u << (i + 1u), h->max_us);
+        }
+    }
+
+    return h->max_us;
+}
+
+static void record(enum tb_latency_stage stage, uint32_t cycles) {
+    uint32_t us = k_cyc_to_us_floor32(cycles);
+    k_spinlock_key_t key = k_spin_lock(&histograms_lock);
+
+    histogram_add(&histograms[stage], us);
+    k_spin_unlock(&histograms_lock, key);
+
+#if defined(CONFIG_TRACING)
+    sys_trace_named_event(stage_names[stage], us, 0u);
+#endif
+}
+
+void tb_latency_begin(struct tb_latency_window *window) {
+    window->begin_cycles = k_cycle_get_32();
+    window->last_cycles = window->begin_cycles;
+    window->active = true;
+}
+
+void tb_latency_mark(struct tb_latency_window *window,
+                     enum tb_latency_stage stage) {
+    uint32_t now;
+
+    if (!window->active) {
+        return;
+    }
+
+    now = k_cycle_get_32();
+    record(stage, now - window->last_cycles);
+    window->last_cycles = now;
+
+    /* The request is out, whatever follows belongs to another message. */
+    if (stage == TB_LATENCY_SEND) {
+        record(TB_LATENCY_TOTAL, now - window->begin_cycles);
+        window->active = false;
+    }
+}
+
+void tb_latency_end(struct tb_latency_window *window) {
+    window->active = false;
+}
+
+void tb_latency_reset(void) {
+    k_spinlock_key_t key = k_spin_lock(&histograms_lock);
+
+    memset(histograms, 0, sizeof(histograms));
+    k_spin_unlock(&histograms_lock, key);
+}
+
+int tb_latency_to_json(char *buf, size_t len) {
+    int i;
+    int ret;
+    size_t used = 0u;
+
+    ret = snprintf(buf, len, "{");
+    if ((ret < 0) || ((size_t)ret >= len)) {
+        return -ENOMEM;
+    }
+    used = ret;
+
+    for (i = 0; i < TB_LATENCY_STAGE_COUNT; i++) {
+        const struct latency_histogram *h = &histograms[i];
+
+        ret = snprintf(&buf[used], len - used,
+                       "%s\"lat_%s_p50\":%u,\"lat_%s_p99\":%u,\"lat_%s_max\":%u",
+                       (i == 0) ? "" : ",", stage_names[i],
+                       histogram_percentile(h, 50u), stage_names[i],
+                       histogram_percentile(h, 99u), stage_names[i], h->max_us);
+        if ((ret < 0) || ((size_t)ret >= len - used)) {
+            return -ENOMEM;
+        }
+        used += ret;
+    }
+
+    ret = snprintf(&buf[used], len - used, "}");
+    if ((ret < 0) || ((size_t)ret >= len - used)) {
+        return -ENOMEM;
+    }
+
+    return used + ret;
+}
+
+#if defined(CONFIG_SHELL)
+
+static int cmd_latency_show(const struct shell *sh, size_t argc, char **argv) {
+    int i;
+    uint32_t b;
+
+    for (i = 0; i < TB_LATENCY_STAGE_COUNT; i++) {
+        const struct latency_histogram *h = &histograms[i];
+
+        shell_print(sh, "%-8s count %u p50 %u us p99 %u us max %u us",
+                    stage_names[i], h->count, histogram_percentile(h, 50u),
+                    histogram_percentile(h, 99u), h->max_us);
+
+        for (b = 0u; b < LATENCY_BUCKETS; b++) {
+            if (h->buckets[b] == 0u) {
+                continue;
+            }
+
+            if (b == LATENCY_BUCKETS - 1u) {
+                shell_print(sh, "  >= %u us: %u", 1u << b, h->buckets[b]);
+            } else {
+                shell_print(sh, "  <  %u us: %u", 1u << (b + 1u), h->buckets[b]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int cmd_latency_reset(const struct shell *sh, size_t argc, char **argv) {
+    tb_latency_reset();
+    shell_print(sh, "Latency histograms cleared");
+
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_latency,
+    SHELL_CMD(reset, NULL, "Clear the histograms", cmd_latency_reset),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_tb,
+    SHELL_CMD(latency, &sub_latency, "Show hot path latency histograms",
+              cmd_latency_show),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(tb, &sub_tb, "ThingsBoard client commands", NULL);
+
+#endif
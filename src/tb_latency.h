@@ -0,0 +1,70 @@
+/* Hot path latency histograms. */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __TB_LATENCY_H__
+#define __TB_LATENCY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Stages of a received message, in order. Each one measures the time since
+ * the previous recorded stage, TOTAL the time since the poll wakeup.
+ */
+enum tb_latency_stage {
+    TB_LATENCY_INPUT,    /* poll wakeup -> MQTT PUBLISH event */
+    TB_LATENCY_COPY,     /* payload copied to the application buffer */
+    TB_LATENCY_DISPATCH, /* topic matched in process_message() */
+    TB_LATENCY_FLASH,    /* firmware chunk stored */
+    TB_LATENCY_SEND,     /* next request published */
+    TB_LATENCY_TOTAL,
+    TB_LATENCY_STAGE_COUNT,
+};
+
+/* Measurement window of one client, the histograms are shared by all. */
+struct tb_latency_window {
+    bool active;
+    uint32_t begin_cycles;
+    uint32_t last_cycles;
+};
+
+#if defined(CONFIG_TB_LATENCY_TRACE)
+
+/**
+ * Start a measurement window, on poll wakeup with data to read.
+ */
+void tb_latency_begin(struct tb_latency_window *window);
+
+/**
+ * Record a stage, ignored outside of a measurement window.
+ */
+void tb_latency_mark(struct tb_latency_window *window,
+                     enum tb_latency_stage stage);
+
+/**
+ * Close the measurement window, once the wakeup has been fully handled.
+ */
+void tb_latency_end(struct tb_latency_window *window);
+
+void tb_latency_reset(void);
+
+/**
+ * Encode p50/p99/max of every stage as a telemetry JSON object.
+ */
+int tb_latency_to_json(char *buf, size_t len);
+
+#else
+
+static inline void tb_latency_begin(struct tb_latency_window *window) {}
+static inline void tb_latency_mark(struct tb_latency_window *window,
+                                   enum tb_latency_stage stage) {}
+static inline void tb_latency_end(struct tb_latency_window *window) {}
+static inline void tb_latency_reset(void) {}
+
+#endif
+
+#endif
@@ -0,0 +1,290 @@
+/* Secondary MQTT session for firmware chunks.
+ *
+ * Opened only while a firmware download is in progress, so that chunks do
+ * not share the socket and the small buffers of the main session with the
+ * telemetry. ThingsBoard answers a chunk request on the session which sent
+ * it, the chunk topics are subscribed at QoS 0 since lost chunks are already
+ * requested again on timeout.
+ *
+ * mqtt_connect() blocks for the whole TCP and TLS handshake, so it runs on a
+ * work queue shared by all the sessions. The client thread only polls the
+ * session socket once the connection is up (state OTA_CONNECTED); a session
+ * closed while connecting (OTA_CLOSING) is disconnected by the work item.
+ */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "tb_ota_session.h"
+
+#include "mqtt_firmware_update.h"
+#include "tb_client.h"
+#include "tb_events.h"
+#include "tb_latency.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <zephyr/init.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/socket.h>
+
+LOG_MODULE_DECLARE(tb, CONFIG_TB_LOG_LEVEL);
+
+#define OTA_CHUNK_TOPIC "v2/fw/response/+/chunk/+"
+
+/* The TLS handshake used to run on the client thread, size it alike. */
+#define OTA_WQ_STACK_SIZE 4096
+#define OTA_WQ_PRIORITY K_PRIO_PREEMPT(8)
+
+enum ota_state {
+    OTA_CLOSED,
+    OTA_CONNECTING,
+    OTA_CONNECTED,
+    OTA_CLOSING,
+};
+
+static K_THREAD_STACK_DEFINE(ota_wq_stack, OTA_WQ_STACK_SIZE);
+static struct k_work_q ota_wq;
+
+static int ota_subscribe(struct tb_ota_session *session) {
+    struct mqtt_topic topic = {
+        .topic = {.utf8 = OTA_CHUNK_TOPIC, .size = strlen(OTA_CHUNK_TOPIC)},
+        .qos = MQTT_QOS_0_AT_MOST_ONCE,
+    };
+    const struct mqtt_subscription_list sub_list = {
+        .list = &topic,
+        .list_count = 1u,
+        .message_id = 1u,
+    };
+
+    return mqtt_subscribe(&session->mqtt, &sub_list);
+}
+
+static int ota_handle_chunk(struct tb_ota_session *session,
+                            const struct mqtt_publish_param *pub) {
+    int ret;
+    size_t received = 0u;
+    const size_t message_size = pub->message.payload.len;
+    const bool discarded = message_size > CONFIG_TB_OTA_CHUNK_SIZE;
+    struct tb_latency_window *latency = &session->owner->latency;
+
+    tb_latency_mark(latency, TB_LATENCY_INPUT);
+
+    while (received < message_size) {
+        uint8_t *p = discarded ? session->chunk_buffer
+                               : &session->chunk_buffer[received];
+
+        ret = mqtt_read_publish_payload_blocking(&session->mqtt, p,
+                                                 CONFIG_TB_OTA_CHUNK_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+
+        received += ret;
+    }
+
+    tb_latency_mark(latency, TB_LATENCY_COPY);
+
+    if (discarded) {
+        LOG_ERR("Chunk of %u B discarded, larger than %u B",
+                (uint32_t)message_size, CONFIG_TB_OTA_CHUNK_SIZE);
+        return -ENOMEM;
+    }
+
+    process_message(session->owner, pub, session->chunk_buffer, message_size);
+
+    return 0;
+}
+
+static void ota_event_cb(struct mqtt_client *client,
+                         const struct mqtt_evt *evt) {
+    struct tb_ota_session *session =
+        CONTAINER_OF(client, struct tb_ota_session, mqtt);
+
+    switch (evt->type) {
+        case MQTT_EVT_CONNACK: {
+            if (evt->result != 0) {
+                LOG_ERR("OTA session refused: %d", evt->result);
+                break;
+            }
+
+            if (ota_subscribe(session) != 0) {
+                LOG_ERR("Failed to subscribe OTA session");
+            }
+        } break;
+
+        case MQTT_EVT_SUBACK: {
+            LOG_INF("OTA session ready");
+            session->ready = true;
+
+            /* Resume right away on the new session. */
+            tb_event_post(&session->owner->events, TB_EVENT_CHUNK_REQUEST);
+        } break;
+
+        case MQTT_EVT_PUBLISH: {
+            ota_handle_chunk(session, &evt->param.publish);
+        } break;
+
+        case MQTT_EVT_DISCONNECT: {
+            session->ready = false;
+        } break;
+
+        default:
+            break;
+    }
+}
+
+static void ota_connect_work(struct k_work *work) {
+    struct tb_ota_session *session =
+        CONTAINER_OF(work, struct tb_ota_session, connect_work);
+    int ret;
+
+    ret = mqtt_connect(&session->mqtt);
+    if (ret != 0) {
+        /* The chunk requests stay on the main session. */
+        LOG_ERR("Failed to open OTA session: %d", ret);
+        atomic_set(&session->state, OTA_CLOSED);
+        return;
+    }
+
+    if (!atomic_cas(&session->state, OTA_CONNECTING, OTA_CONNECTED)) {
+        /* Closed by the client thread during the handshake. */
+        mqtt_disconnect(&session->mqtt);
+        atomic_set(&session->state, OTA_CLOSED);
+        return;
+    }
+
+    LOG_INF("OTA session opened");
+
+    /* Also wakes the client thread up to poll the new socket. */
+    tb_event_post(&session->owner->events, TB_EVENT_OTA_CONNECTED);
+}
+
+void tb_ota_session_init(struct tb_ota_session *session, struct tb_client *owner) {
+    session->owner = owner;
+    atomic_set(&session->state, OTA_CLOSED);
+    k_work_init(&session->connect_work, ota_connect_work);
+}
+
+int tb_ota_session_open(struct tb_ota_session *session) {
+    struct mqtt_client *ota_client = &session->mqtt;
+    const struct mqtt_client *main_client = &session->owner->mqtt;
+
+    if (!atomic_cas(&session->state, OTA_CLOSED, OTA_CONNECTING)) {
+        return (atomic_get(&session->state) == OTA_CLOSING) ? -EBUSY : 0;
+    }
+
+    mqtt_client_init(ota_client);
+
+    snprintf(session->client_id, sizeof(session->client_id), "%s-ota",
+             session->owner->name);
+
+    ota_client->broker = main_client->broker;
+    ota_client->evt_cb = ota_event_cb;
+    ota_client->client_id.utf8 = (uint8_t *)session->client_id;
+    ota_client->client_id.size = strlen(session->client_id);
+    ota_client->password = NULL;
+    /* Same device credentials, the session only differs by client id. */
+    ota_client->user_name = main_client->user_name;
+    ota_client->keepalive = CONFIG_MQTT_KEEPALIVE;
+    ota_client->protocol_version = MQTT_VERSION_3_1_1;
+
+    ota_client->rx_buf = session->rx_buffer;
+    ota_client->rx_buf_size = sizeof(session->rx_buffer);
+    ota_client->tx_buf = session->tx_buffer;
+    ota_client->tx_buf_size = sizeof(session->tx_buffer);
+
+    /* Same transport and TLS credentials as the main session. */
+    ota_client->transport = main_client->transport;
+
+    session->ready = false;
+
+    k_work_submit_to_queue(&ota_wq, &session->connect_work);
+
+    return 0;
+}
+
+void tb_ota_session_close(struct tb_ota_session *session) {
+    /* Left to the connect work item if it has not returned yet. */
+    if (atomic_cas(&session->state, OTA_CONNECTING, OTA_CLOSING)) {
+        return;
+    }
+
+    if (!atomic_cas(&session->state, OTA_CONNECTED, OTA_CLOSING)) {
+        return;
+    }
+
+    /* Also closes the socket, unless the library already did on error. */
+    mqtt_disconnect(&session->mqtt);
+
+    session->ready = false;
+    atomic_set(&session->state, OTA_CLOSED);
+
+    LOG_INF("OTA session closed");
+}
+
+bool tb_ota_session_ready(const struct tb_ota_session *session) {
+    return session->ready;
+}
+
+struct mqtt_client *tb_ota_session_client(struct tb_ota_session *session) {
+    return &session->mqtt;
+}
+
+static bool ota_connected(const struct tb_ota_session *session) {
+    return atomic_get(&session->state) == OTA_CONNECTED;
+}
+
+int tb_ota_session_fd(const struct tb_ota_session *session) {
+    return ota_connected(session) ? session->mqtt.transport.tcp.sock : -1;
+}
+
+void tb_ota_session_process(struct tb_ota_session *session, short revents) {
+    int rc;
+
+    if (!ota_connected(session)) {
+        return;
+    }
+
+    if (revents & ZSOCK_POLLIN) {
+        rc = mqtt_input(&session->mqtt);
+        if (rc != 0) {
+            LOG_ERR("Failed to read OTA session input: %d", rc);
+            tb_ota_session_close(session);
+            return;
+        }
+    }
+
+    if (revents & (ZSOCK_POLLHUP | ZSOCK_POLLERR)) {
+        LOG_ERR("OTA session socket closed/error");
+        tb_ota_session_close(session);
+        return;
+    }
+
+    rc = mqtt_live(&session->mqtt);
+    if ((rc != 0) && (rc != -EAGAIN)) {
+        LOG_ERR("Failed to live OTA session: %d", rc);
+        tb_ota_session_close(session);
+    }
+}
+
+int tb_ota_session_keepalive_time_left(struct tb_ota_session *session) {
+    return ota_connected(session) ? mqtt_keepalive_time_left(&session->mqtt)
+                                  : SYS_FOREVER_MS;
+}
+
+static int ota_wq_init(void) {
+    const struct k_work_queue_config ota_wq_cfg = {.name = "ota_wq"};
+
+    k_work_queue_start(&ota_wq, ota_wq_stack,
+                       K_THREAD_STACK_SIZEOF(ota_wq_stack), OTA_WQ_PRIORITY,
+                       &ota_wq_cfg);
+
+    return 0;
+}
+
+SYS_INIT(ota_wq_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
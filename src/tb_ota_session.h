@@ -0,0 +1,72 @@
+/* Secondary MQTT session for firmware chunks. */
+
+/*
+ * Copyright (c) 2024, CATIE
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __TB_OTA_SESSION_H__
+#define __TB_OTA_SESSION_H__
+
+#include <stdbool.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/net/mqtt.h>
+#include <zephyr/sys/atomic.h>
+
+#define TB_OTA_MQTT_BUFFER_SIZE 512u
+
+struct tb_client;
+
+struct tb_ota_session {
+    struct mqtt_client mqtt;
+    struct tb_client *owner;
+    uint8_t rx_buffer[TB_OTA_MQTT_BUFFER_SIZE];
+    uint8_t tx_buffer[TB_OTA_MQTT_BUFFER_SIZE];
+    /* One extra byte for process_message() to terminate text payloads. */
+    uint8_t chunk_buffer[CONFIG_TB_OTA_CHUNK_SIZE + 1];
+    char client_id[48];
+    /* Connected from a work queue, see tb_ota_session_open(). */
+    struct k_work connect_work;
+    atomic_t state;
+    bool ready;
+};
+
+void tb_ota_session_init(struct tb_ota_session *session, struct tb_client *owner);
+
+/**
+ * Start opening the session with the broker and TLS settings of the owner's
+ * main session. The connection, TLS handshake included, is made from a work
+ * queue so that the client thread keeps serving the main session; the owner
+ * gets TB_EVENT_OTA_CONNECTED once the socket can be polled, and the chunk
+ * requests are resumed (TB_EVENT_CHUNK_REQUEST) once it is subscribed.
+ *
+ * @return 0 if opening or already open, -EBUSY while still being closed.
+ */
+int tb_ota_session_open(struct tb_ota_session *session);
+
+void tb_ota_session_close(struct tb_ota_session *session);
+
+/**
+ * True once connected and subscribed to the chunk responses.
+ */
+bool tb_ota_session_ready(const struct tb_ota_session *session);
+
+struct mqtt_client *tb_ota_session_client(struct tb_ota_session *session);
+
+/**
+ * Socket to poll, -1 until the session is connected.
+ */
+int tb_ota_session_fd(const struct tb_ota_session *session);
+
+/**
+ * Handle the poll result of the session socket, closing it on error.
+ */
+void tb_ota_session_process(struct tb_ota_session *session, short revents);
+
+/**
+ * Time until the next keepalive, SYS_FOREVER_MS until connected.
+ */
+int tb_ota_session_keepalive_time_left(struct tb_ota_session *session);
+
+#endif